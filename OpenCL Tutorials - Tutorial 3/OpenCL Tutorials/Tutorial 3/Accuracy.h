@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Stats.h"
+#include "Reduction.h"
+#include "BufferPool.h"
+
+// timed runs of each device reduction in the accuracy comparison, the fastest one counts
+const int ACCURACY_REPETITIONS = 5;
+
+// reference mean and variance, two passes in long double
+struct ReferenceStats {
+	long double mean;
+	long double variance;
+};
+
+inline ReferenceStats HostReferenceStats(const float* data, size_t n) {
+	ReferenceStats ref = { 0, 0 };
+	if (!n)
+		return ref;
+	long double sum = 0;
+	for (size_t i = 0; i < n; i++)
+		sum += data[i];
+	ref.mean = sum / n;
+	long double squares = 0;
+	for (size_t i = 0; i < n; i++) {
+		long double d = data[i] - ref.mean;
+		squares += d * d;
+	}
+	ref.variance = (n > 1) ? squares / (n - 1) : 0;
+	return ref;
+}
+
+// the naive host loop the device path replaced: sum and sum of squares in float, variance from their difference
+inline StatsSummary HostFloatStats(const float* data, size_t n) {
+	StatsSummary stats;
+	float sum = 0, squares = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += data[i];
+		squares += data[i] * data[i];
+	}
+	stats.count = n;
+	stats.mean = sum / n;
+	stats.m2 = squares - sum * (double)stats.mean;
+	return stats;
+}
+
+// run a two-pass device reduction ACCURACY_REPETITIONS times, returning the fastest device time in ns
+// the commands of every repetition are appended to events
+inline double TimeDeviceStats(BufferPool& pool, cl::CommandQueue& queue, cl::Kernel& first_pass, cl::Kernel& merge_pass,
+	const cl::Buffer& input, size_t n, size_t local_size, StatsSummary& result, std::vector<cl::Event>& events) {
+
+	PooledBuffer ping = pool.Acquire(PartialsBufferSize(n, local_size));
+	PooledBuffer pong = pool.Acquire(PartialsBufferSize(n, local_size));
+	double best = -1;
+	for (int r = 0; r < ACCURACY_REPETITIONS; r++) {
+		std::vector<cl::Event> run_events;
+		StatsPartial partial = ReduceStatsOnDevice(queue, first_pass, merge_pass, input, n, ping, pong, local_size, run_events);
+		events.insert(events.end(), run_events.begin(), run_events.end());
+		double time = GetTotalExecutionTime(run_events);
+		if (best < 0 || time < best)
+			best = time;
+		result = StatsSummary();
+		CombineStats(result, partial);
+	}
+	return best;
+}
+
+inline void PrintAccuracyHeader(std::ostream& out) {
+	out << std::left << std::setw(24) << "Method" << std::right << std::setw(16) << "Mean" << std::setw(12) << "Mean err"
+		<< std::setw(16) << "StdDev" << std::setw(12) << "StdDev err" << std::setw(14) << "Time [us]" << std::setw(10) << "GB/s" << std::endl;
+}
+
+// one row of the comparison: the result, its relative errors against the reference and the throughput over bytes
+inline void PrintAccuracyRow(std::ostream& out, const std::string& method, const StatsSummary& stats, const ReferenceStats& ref,
+	double time_ns, size_t bytes) {
+	long double ref_stddev = std::sqrt(ref.variance);
+	double mean_error = ref.mean ? (double)std::fabs((stats.mean - ref.mean) / ref.mean) : 0;
+	double stddev_error = ref_stddev ? (double)std::fabs((stats.StdDev() - ref_stddev) / ref_stddev) : 0;
+
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::left << std::setw(24) << method << std::right << std::fixed << std::setprecision(9)
+		<< std::setw(16) << stats.mean << std::scientific << std::setprecision(2) << std::setw(12) << mean_error
+		<< std::fixed << std::setprecision(9) << std::setw(16) << stats.StdDev() << std::scientific << std::setprecision(2) << std::setw(12) << stddev_error
+		<< std::fixed << std::setprecision(1) << std::setw(14) << time_ns / 1000 << std::setprecision(2) << std::setw(10) << (time_ns > 0 ? bytes / time_ns : 0) << std::endl;
+	out.flags(flags);
+	out.precision(precision);
+}
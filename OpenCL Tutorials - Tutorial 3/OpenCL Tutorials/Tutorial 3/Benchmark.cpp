@@ -0,0 +1,450 @@
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "StatsEngine.h"
+#include "NativeStats.h"
+#include "TypedStats.h"
+#include "Accuracy.h"
+#include "Dataset.h"
+#include "Parallel.h"
+
+// reproducible benchmark of every statistics variant over a range of dataset sizes
+// the datasets are synthetic (seeded, so every run sees the same values) or a text dataset tiled up to each size;
+// each variant runs its warm-up calls, then its timed repetitions, and the median and 95th percentile are reported
+// next to the effective bandwidth, the bandwidth the hardware can reach and the end-to-end time
+
+namespace {
+
+const size_t DEFAULT_WARMUP = 2;
+const size_t DEFAULT_REPETITIONS = 10;
+const unsigned DEFAULT_SEED = 42;
+
+// elements generated per task, each block has its own seed so the data doesn't depend on the thread count
+const size_t GENERATE_BLOCK = 1 << 20;
+
+// buffer used to measure the copy bandwidth of a device
+const size_t BANDWIDTH_PROBE_BYTES = 256 << 20;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// host results are stored here so the compiler can't drop the calls that produce them
+volatile double result_sink;
+
+double ElapsedMs(Clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / 1e6;
+}
+
+// sizes like 1K, 10M or 1G, in powers of ten
+size_t ParseSize(const std::string& text) {
+	char* end = 0;
+	double value = strtod(text.c_str(), &end);
+	switch (*end) {
+	case 'K': case 'k': value *= 1e3; break;
+	case 'M': case 'm': value *= 1e6; break;
+	case 'G': case 'g': case 'B': case 'b': value *= 1e9; break;
+	default: break;
+	}
+	if (value < 1)
+		throw std::runtime_error("Invalid dataset size " + text);
+	return (size_t)value;
+}
+
+std::vector<std::string> SplitList(const std::string& text) {
+	std::vector<std::string> items;
+	std::stringstream stream(text);
+	std::string item;
+	while (getline(stream, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+// temperature-like values, normal around 10 degrees with a standard deviation of 8
+void GenerateSynthetic(float* out, size_t n, unsigned seed) {
+	size_t blocks = (n + GENERATE_BLOCK - 1) / GENERATE_BLOCK;
+	DefaultThreadPool().ParallelFor(blocks, [&](size_t b) {
+		std::mt19937 engine(seed + (unsigned)b * 7919u);
+		std::normal_distribution<float> temperature(10.0f, 8.0f);
+		size_t end = std::min(n, (b + 1) * GENERATE_BLOCK);
+		for (size_t i = b * GENERATE_BLOCK; i < end; i++)
+			out[i] = temperature(engine);
+	});
+}
+
+// the source values repeated up to n elements
+void Tile(float* out, size_t n, const std::vector<float>& source) {
+	for (size_t filled = 0; filled < n; filled += source.size())
+		memcpy(out + filled, &source[0], std::min(source.size(), n - filled) * sizeof(float));
+}
+
+// nearest-rank percentile of a sample
+double Percentile(std::vector<double> values, double percentile) {
+	if (values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	size_t rank = (size_t)std::ceil(percentile / 100.0 * values.size());
+	return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// a variant runs one call and returns its device time in ms, or a negative value when it has none (host variants)
+struct Variant {
+	std::string name;
+	std::string backend;
+	size_t element_bytes; // bytes it reads per element
+	size_t max_elements;  // largest dataset it takes in one call
+	std::function<double(const float*, size_t)> run;
+};
+
+struct Result {
+	std::string variant;
+	std::string backend;
+	size_t elements;
+	size_t bytes;
+	size_t warmup;
+	size_t repetitions;
+	double median_ms;
+	double p95_ms;
+	double min_ms;
+	double device_median_ms; // negative for host variants
+	double gbps;             // bytes over the median device time, or the median wall time on the host
+	double peak_gbps;
+	double prepare_ms;       // generating or parsing and tiling the dataset
+	double end_to_end_ms;    // prepare_ms plus the median wall time of a call, transfers included
+};
+
+// copy bandwidth of a device (read plus write), the best of a few copies
+double DeviceCopyBandwidth(const cl::Context& context, cl::CommandQueue& queue, const cl::Device& device) {
+	size_t bytes = std::min<size_t>(BANDWIDTH_PROBE_BYTES, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / 2);
+	cl::Buffer source(context, CL_MEM_READ_WRITE, bytes), target(context, CL_MEM_READ_WRITE, bytes);
+	queue.enqueueFillBuffer(source, (cl_uint)0, 0, bytes);
+	double best = -1;
+	for (int r = 0; r < 5; r++) {
+		std::vector<cl::Event> events(1);
+		queue.enqueueCopyBuffer(source, target, 0, 0, bytes, NULL, &events[0]);
+		events[0].wait();
+		double time = GetTotalExecutionTime(events);
+		if (best < 0 || time < best)
+			best = time;
+	}
+	return 2.0 * bytes / best;
+}
+
+// the same for host memory, copied in parallel
+double HostCopyBandwidth() {
+	size_t bytes = BANDWIDTH_PROBE_BYTES, blocks = bytes / GENERATE_BLOCK;
+	std::vector<char> source(bytes, 1), target(bytes);
+	double best = -1;
+	for (int r = 0; r < 5; r++) {
+		Clock::time_point start = Clock::now();
+		DefaultThreadPool().ParallelFor(blocks, [&](size_t b) {
+			memcpy(&target[b * GENERATE_BLOCK], &source[b * GENERATE_BLOCK], GENERATE_BLOCK);
+		});
+		double time = ElapsedMs(start) * 1e6;
+		if (best < 0 || time < best)
+			best = time;
+	}
+	return 2.0 * bytes / best;
+}
+
+void WriteJson(std::ostream& out, const std::string& device, const std::string& peak_source, const std::vector<Result>& results) {
+	out << "{\n\"device\": \"" << device << "\",\n\"peak_source\": \"" << peak_source << "\",\n\"results\": [";
+	out << std::fixed << std::setprecision(4);
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		out << (i ? ",\n" : "\n") << "{\"variant\": \"" << r.variant << "\", \"backend\": \"" << r.backend << "\", \"elements\": " << r.elements
+			<< ", \"bytes\": " << r.bytes << ", \"warmup\": " << r.warmup << ", \"repetitions\": " << r.repetitions
+			<< ", \"median_ms\": " << r.median_ms << ", \"p95_ms\": " << r.p95_ms << ", \"min_ms\": " << r.min_ms
+			<< ", \"device_median_ms\": ";
+		if (r.device_median_ms < 0)
+			out << "null";
+		else
+			out << r.device_median_ms;
+		out << ", \"gbps\": " << r.gbps << ", \"peak_gbps\": " << r.peak_gbps << ", \"prepare_ms\": " << r.prepare_ms
+			<< ", \"end_to_end_ms\": " << r.end_to_end_ms << "}";
+	}
+	out << "\n]\n}" << std::endl;
+}
+
+void WriteCsv(std::ostream& out, const std::vector<Result>& results) {
+	out << "variant,backend,elements,bytes,warmup,repetitions,median_ms,p95_ms,min_ms,device_median_ms,gbps,peak_gbps,prepare_ms,end_to_end_ms" << std::endl;
+	out << std::fixed << std::setprecision(4);
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& r = results[i];
+		out << r.variant << "," << r.backend << "," << r.elements << "," << r.bytes << "," << r.warmup << "," << r.repetitions << ","
+			<< r.median_ms << "," << r.p95_ms << "," << r.min_ms << ",";
+		if (r.device_median_ms >= 0)
+			out << r.device_median_ms;
+		out << "," << r.gbps << "," << r.peak_gbps << "," << r.prepare_ms << "," << r.end_to_end_ms << std::endl;
+	}
+}
+
+void PrintRow(std::ostream& out, const Result& r) {
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::left << std::setw(16) << r.variant << std::right << std::setw(12) << r.elements << std::fixed << std::setprecision(3)
+		<< std::setw(12) << r.median_ms << std::setw(12) << r.p95_ms << std::setw(12);
+	if (r.device_median_ms < 0)
+		out << "-";
+	else
+		out << r.device_median_ms;
+	out << std::setprecision(2) << std::setw(10) << r.gbps << std::setw(8) << (r.peak_gbps > 0 ? 100 * r.gbps / r.peak_gbps : 0) << "%"
+		<< std::setprecision(3) << std::setw(14) << r.end_to_end_ms << std::endl;
+	out.flags(flags);
+	out.precision(precision);
+}
+
+void print_help() {
+	std::cerr << "Benchmark usage:" << std::endl;
+
+	std::cerr << "  -p : select platform " << std::endl;
+	std::cerr << "  -d : select device" << std::endl;
+	std::cerr << "  -z : dataset sizes (default 1K,10K,100K,1M,10M,100M, up to 1G)" << std::endl;
+	std::cerr << "  -f : tile this text dataset up to each size instead of generating values (e.g. temp_lincolnshire_short.txt)" << std::endl;
+	std::cerr << "  -v : variants to run (default all): fused,precise,half,float,double,native,naive" << std::endl;
+	std::cerr << "  -w : warm-up calls per variant and size (default 2)" << std::endl;
+	std::cerr << "  -r : timed repetitions per variant and size (default 10)" << std::endl;
+	std::cerr << "  -s : seed of the synthetic data (default 42)" << std::endl;
+	std::cerr << "  -B : theoretical bandwidth of the device in GB/s (default: its measured copy bandwidth)" << std::endl;
+	std::cerr << "  -o : write the results to this file, as CSV for a .csv name and as JSON otherwise" << std::endl;
+	std::cerr << "  -h : print this message" << std::endl;
+}
+
+}
+
+int main(int argc, char **argv) {
+	StatsEngineOptions options;
+	std::vector<size_t> sizes;
+	std::string tile_file, output_file;
+	std::vector<std::string> selected;
+	size_t warmup = DEFAULT_WARMUP, repetitions = DEFAULT_REPETITIONS;
+	unsigned seed = DEFAULT_SEED;
+	double peak_gbps = 0;
+
+	// bad options throw too, so they are reported like any other error
+	try {
+		for (int i = 1; i < argc; i++) {
+			if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { options.platform_id = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { options.device_id = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-z") == 0) && (i < (argc - 1))) {
+				std::vector<std::string> items = SplitList(argv[++i]);
+				for (size_t j = 0; j < items.size(); j++)
+					sizes.push_back(ParseSize(items[j]));
+			}
+			else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { tile_file = argv[++i]; }
+			else if ((strcmp(argv[i], "-v") == 0) && (i < (argc - 1))) { selected = SplitList(argv[++i]); }
+			else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) {
+				int count = atoi(argv[++i]);
+				if (count < 0)
+					throw std::runtime_error("-w takes a non-negative number of warm-up calls");
+				warmup = (size_t)count;
+			}
+			else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { repetitions = std::max(1, atoi(argv[++i])); }
+			else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { seed = (unsigned)atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-B") == 0) && (i < (argc - 1))) { peak_gbps = atof(argv[++i]); }
+			else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_file = argv[++i]; }
+			else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
+		}
+		if (sizes.empty())
+			for (size_t n = 1000; n <= 100000000; n *= 10)
+				sizes.push_back(n);
+
+		// the source of a tiled dataset is parsed once, its parse time counts towards every size
+		std::vector<float> source;
+		double parse_ms = 0;
+		if (!tile_file.empty()) {
+			Clock::time_point start = Clock::now();
+			Dataset parsed;
+			LoadDataset(tile_file, parsed);
+			parse_ms = ElapsedMs(start);
+			if (parsed.empty())
+				throw std::runtime_error("The dataset has no records");
+			source.assign(parsed.temperature.data(), parsed.temperature.data() + parsed.size());
+		}
+
+		// the OpenCL variants are left out when there is no device
+		std::unique_ptr<StatsEngine> fast, precise;
+		std::string device_name = "none";
+		double device_peak = 0, host_peak = HostCopyBandwidth();
+		std::string peak_source = "measured copy";
+		try {
+			fast.reset(new StatsEngine(options));
+			StatsEngineOptions precise_options = options;
+			precise_options.precise = true;
+			precise.reset(new StatsEngine(precise_options));
+			device_name = fast->Name();
+			device_peak = DeviceCopyBandwidth(fast->Context(), fast->Queue(), fast->Device());
+		}
+		catch (const std::exception& err) {
+			std::cerr << "No OpenCL device, running the host variants only (" << err.what() << ")" << std::endl;
+			fast.reset();
+			precise.reset();
+		}
+		if (peak_gbps > 0) {
+			device_peak = peak_gbps;
+			peak_source = "given";
+		}
+
+		std::vector<Variant> variants;
+		NativeStats native;
+		if (fast) {
+			Variant fused = { "fused", "opencl", sizeof(float), (size_t)-1, [&](const float* data, size_t n) {
+				fast->Compute(data, n);
+				return GetTotalExecutionTime(fast->Events()) / 1e6;
+			} };
+			Variant precise_variant = { "precise", "opencl", sizeof(float), (size_t)-1, [&](const float* data, size_t n) {
+				precise->Compute(data, n);
+				return GetTotalExecutionTime(precise->Events()) / 1e6;
+			} };
+			variants.push_back(fused);
+			variants.push_back(precise_variant);
+
+			// typed jobs take the whole dataset in one allocation; double is left out on devices without fp64
+			size_t max_alloc = (size_t)fast->Device().getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			std::shared_ptr<TypedStats<cl_half> > half_job(new TypedStats<cl_half>(fast->Context(), fast->Sources()));
+			std::shared_ptr<TypedStats<cl_float> > float_job(new TypedStats<cl_float>(fast->Context(), fast->Sources()));
+			Variant half = { "half", "opencl", sizeof(cl_half), max_alloc / sizeof(cl_half), [=, &fast](const float* data, size_t n) {
+				std::vector<cl::Event> events;
+				half_job->Compute(fast->Queue(), fast->Pool(), data, n, events);
+				return GetTotalExecutionTime(events) / 1e6;
+			} };
+			Variant single = { "float", "opencl", sizeof(cl_float), max_alloc / sizeof(cl_float), [=, &fast](const float* data, size_t n) {
+				std::vector<cl::Event> events;
+				float_job->Compute(fast->Queue(), fast->Pool(), data, n, events);
+				return GetTotalExecutionTime(events) / 1e6;
+			} };
+			variants.push_back(half);
+			variants.push_back(single);
+			if (fast->Device().getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>()) {
+				std::shared_ptr<TypedStats<cl_double> > double_job(new TypedStats<cl_double>(fast->Context(), fast->Sources()));
+				Variant double_variant = { "double", "opencl", sizeof(cl_double), max_alloc / sizeof(cl_double), [=, &fast](const float* data, size_t n) {
+					std::vector<cl::Event> events;
+					double_job->Compute(fast->Queue(), fast->Pool(), data, n, events);
+					return GetTotalExecutionTime(events) / 1e6;
+				} };
+				variants.push_back(double_variant);
+			}
+		}
+		Variant native_variant = { "native", "native", sizeof(float), (size_t)-1, [&](const float* data, size_t n) {
+			result_sink = native.Compute(data, n).summary.mean;
+			return -1.0;
+		} };
+		Variant naive = { "naive", "host", sizeof(float), (size_t)-1, [](const float* data, size_t n) {
+			result_sink = HostFloatStats(data, n).mean;
+			return -1.0;
+		} };
+		variants.push_back(native_variant);
+		variants.push_back(naive);
+
+		if (!selected.empty()) {
+			std::vector<Variant> kept;
+			for (size_t i = 0; i < variants.size(); i++)
+				if (std::find(selected.begin(), selected.end(), variants[i].name) != selected.end())
+					kept.push_back(variants[i]);
+			variants.swap(kept);
+		}
+
+		std::cout << "Device: " << device_name << ", " << native.Name() << std::endl;
+		std::cout << "Peak bandwidth: device " << device_peak << " GB/s (" << peak_source << "), host " << host_peak << " GB/s (measured copy)" << std::endl;
+		std::cout << "Data: " << (tile_file.empty() ? "synthetic, seed " + std::to_string(seed) : tile_file + " tiled") << ", "
+			<< warmup << " warm-up calls, " << repetitions << " repetitions\n" << std::endl;
+		std::cout << std::left << std::setw(16) << "Variant" << std::right << std::setw(12) << "Elements" << std::setw(12) << "Median [ms]"
+			<< std::setw(12) << "P95 [ms]" << std::setw(12) << "Device [ms]" << std::setw(10) << "GB/s" << std::setw(9) << "Peak"
+			<< std::setw(14) << "End-to-end" << std::endl;
+
+		std::vector<Result> results;
+		size_t largest = *std::max_element(sizes.begin(), sizes.end());
+		AlignedFloatArray data;
+		data.Allocate(largest);
+
+		for (size_t s = 0; s < sizes.size(); s++) {
+			size_t n = sizes[s];
+			Clock::time_point prepare_start = Clock::now();
+			if (source.empty())
+				GenerateSynthetic(data.data(), n, seed);
+			else
+				Tile(data.data(), n, source);
+			data.SetSize(n);
+			double prepare_ms = ElapsedMs(prepare_start) + parse_ms;
+
+			for (size_t v = 0; v < variants.size(); v++) {
+				const Variant& variant = variants[v];
+				if (n > variant.max_elements)
+					continue;
+
+				std::vector<double> wall, device;
+				for (size_t r = 0; r < warmup + repetitions; r++) {
+					Clock::time_point start = Clock::now();
+					double device_ms = variant.run(data.data(), n);
+					double wall_ms = ElapsedMs(start);
+					if (r >= warmup) {
+						wall.push_back(wall_ms);
+						if (device_ms >= 0)
+							device.push_back(device_ms);
+					}
+				}
+
+				Result result;
+				result.variant = variant.name;
+				result.backend = variant.backend;
+				result.elements = n;
+				result.bytes = n * variant.element_bytes;
+				result.warmup = warmup;
+				result.repetitions = repetitions;
+				result.median_ms = Percentile(wall, 50);
+				result.p95_ms = Percentile(wall, 95);
+				result.min_ms = *std::min_element(wall.begin(), wall.end());
+				result.device_median_ms = device.empty() ? -1 : Percentile(device, 50);
+				double effective_ms = device.empty() ? result.median_ms : result.device_median_ms;
+				result.gbps = effective_ms > 0 ? result.bytes / (effective_ms * 1e6) : 0;
+				result.peak_gbps = (variant.backend == "opencl" ? device_peak : host_peak);
+				result.prepare_ms = prepare_ms;
+				result.end_to_end_ms = prepare_ms + result.median_ms;
+				results.push_back(result);
+				PrintRow(std::cout, result);
+			}
+		}
+
+		if (!output_file.empty()) {
+			std::ofstream out(output_file, std::ios::trunc);
+			if (output_file.size() > 4 && output_file.compare(output_file.size() - 4, 4, ".csv") == 0)
+				WriteCsv(out, results);
+			else
+				WriteJson(out, device_name, peak_source, results);
+			if (!out)
+				throw std::runtime_error("Could not write " + output_file);
+			std::cout << "\nResults written to " << output_file << std::endl;
+		}
+	}
+	catch (cl::Error err) {
+		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+		return 1;
+	}
+	catch (const std::exception& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
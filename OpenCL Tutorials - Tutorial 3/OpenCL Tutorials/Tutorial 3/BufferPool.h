@@ -0,0 +1,173 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <iostream>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+// smallest size class
+const size_t POOL_MIN_BYTES = 4096;
+
+// flags of pinned staging buffers: host-allocated, so mapping them gives the driver page-locked memory it can copy
+// from at full bus speed without an extra bounce
+const cl_mem_flags POOL_STAGING_FLAGS = CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR;
+
+class BufferPool;
+
+// a buffer on loan from a BufferPool, given back when the handle goes out of scope
+// move-only; Size() is the size class, at least what was asked for
+class PooledBuffer {
+public:
+	PooledBuffer() : pool_(0), size_(0), flags_(0) {}
+	PooledBuffer(PooledBuffer&& other) : pool_(other.pool_), buffer_(other.buffer_), size_(other.size_), flags_(other.flags_) {
+		other.pool_ = 0;
+		other.buffer_ = cl::Buffer();
+	}
+	PooledBuffer& operator=(PooledBuffer&& other) {
+		if (this != &other) {
+			Release();
+			pool_ = other.pool_;
+			buffer_ = other.buffer_;
+			size_ = other.size_;
+			flags_ = other.flags_;
+			other.pool_ = 0;
+			other.buffer_ = cl::Buffer();
+		}
+		return *this;
+	}
+	~PooledBuffer() { Release(); }
+
+	const cl::Buffer& Buffer() const { return buffer_; }
+	operator const cl::Buffer&() const { return buffer_; }
+	size_t Size() const { return size_; }
+	bool Empty() const { return !pool_; }
+
+	// give the buffer back now
+	inline void Release();
+
+private:
+	friend class BufferPool;
+	PooledBuffer(BufferPool* pool, const cl::Buffer& buffer, size_t size, cl_mem_flags flags) : pool_(pool), buffer_(buffer), size_(size), flags_(flags) {}
+	PooledBuffer(const PooledBuffer&);
+	PooledBuffer& operator=(const PooledBuffer&);
+
+	BufferPool* pool_;
+	cl::Buffer buffer_;
+	size_t size_;
+	cl_mem_flags flags_;
+};
+
+// what a pool has done so far
+struct BufferPoolStats {
+	size_t allocations; // buffers created
+	size_t reuses;      // requests served from the free lists
+	size_t bytes;       // bytes of every buffer it holds, lent out or free
+	size_t peak_bytes;
+	size_t lent;        // buffers lent out right now
+};
+
+// device buffers and pinned staging buffers of one context, by size class and flags
+// a returned buffer goes to the free list of its class and is lent out again to the next request of that class, so
+// once every pass and job has run once, later ones allocate nothing and the memory held stays where it peaked
+// a buffer may be lent out again while commands of its previous holder are still queued: that is safe when both
+// holders use the same in-order queue, holders that use it from other queues must wait for their commands first
+class BufferPool {
+public:
+	explicit BufferPool(const cl::Context& context = cl::Context()) : context_(context) {
+		BufferPoolStats stats = { 0, 0, 0, 0, 0 };
+		stats_ = stats;
+	}
+
+	~BufferPool() {
+		if (stats_.lent)
+			std::cerr << "BufferPool destroyed with " << stats_.lent << " buffers still lent out" << std::endl;
+	}
+
+	// a buffer of at least bytes with exactly these flags
+	// CL_MEM_USE_HOST_PTR and CL_MEM_COPY_HOST_PTR buffers belong to their host memory and are not pooled
+	PooledBuffer Acquire(size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE) {
+		size_t size = SizeClass(bytes);
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<cl::Buffer>& free = free_[std::make_pair(flags, size)];
+		if (!free.empty()) {
+			cl::Buffer buffer = free.back();
+			free.pop_back();
+			stats_.reuses++;
+			stats_.lent++;
+			return PooledBuffer(this, buffer, size, flags);
+		}
+
+		cl::Buffer buffer(context_, flags, size);
+		stats_.allocations++;
+		stats_.lent++;
+		stats_.bytes += size;
+		stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.bytes);
+		return PooledBuffer(this, buffer, size, flags);
+	}
+
+	// pinned host memory to map, fill and copy to (or read back from) the device
+	PooledBuffer AcquireStaging(size_t bytes) {
+		return Acquire(bytes, POOL_STAGING_FLAGS);
+	}
+
+	// free every buffer that isn't lent out
+	void Trim() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl::Buffer> >::iterator it = free_.begin(); it != free_.end(); ++it) {
+			stats_.bytes -= it->first.second * it->second.size();
+			it->second.clear();
+		}
+	}
+
+	BufferPoolStats Stats() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return stats_;
+	}
+
+	// four classes per doubling (5/8, 6/8, 7/8 and 8/8 of a power of two), so a request never gets more than a
+	// quarter more than it asked for and still meets the same class again for slightly different sizes
+	static size_t SizeClass(size_t bytes) {
+		size_t size = POOL_MIN_BYTES;
+		while (size < bytes)
+			size <<= 1;
+		size_t step = size / 8;
+		if (step >= POOL_MIN_BYTES)
+			size = (bytes + step - 1) / step * step;
+		return size;
+	}
+
+private:
+	friend class PooledBuffer;
+	BufferPool(const BufferPool&);
+	BufferPool& operator=(const BufferPool&);
+
+	void Return(const cl::Buffer& buffer, size_t size, cl_mem_flags flags) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_[std::make_pair(flags, size)].push_back(buffer);
+		stats_.lent--;
+	}
+
+	cl::Context context_;
+	mutable std::mutex mutex_;
+	std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl::Buffer> > free_;
+	BufferPoolStats stats_;
+};
+
+inline void PooledBuffer::Release() {
+	if (pool_)
+		pool_->Return(buffer_, size_, flags_);
+	pool_ = 0;
+	buffer_ = cl::Buffer();
+}
+
+inline void PrintPoolStats(std::ostream& out, const BufferPoolStats& stats) {
+	out << "Buffer pool: " << stats.allocations << " allocations, " << stats.reuses << " reuses, " << stats.bytes << " bytes held, peak "
+		<< stats.peak_bytes << " bytes" << std::endl;
+}
@@ -0,0 +1,445 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "Parallel.h"
+
+// alignment and size granularity that lets CL_MEM_USE_HOST_PTR buffers stay zero-copy
+// (page aligned start, size a multiple of a cache line)
+const size_t HOST_PTR_ALIGNMENT = 4096;
+const size_t HOST_PTR_SIZE_MULTIPLE = 64;
+
+// page-aligned array that can be handed to a CL_MEM_USE_HOST_PTR buffer
+// it either owns its allocation or is attached to memory that lives elsewhere (e.g. a mapped cache file)
+template <typename T>
+class AlignedArray {
+public:
+	AlignedArray() : data_(0), size_(0), capacity_(0), owned_(false) {}
+	~AlignedArray() { Free(); }
+
+	// allocate room for n elements
+	// the contents are left uninitialised so the parser threads touch the pages first, only the rounding at the end is zeroed
+	void Allocate(size_t n) {
+		Free();
+		capacity_ = n;
+		size_t bytes = ByteSize();
+		if (!bytes)
+			return;
+#ifdef _WIN32
+		data_ = (T*)_aligned_malloc(bytes, HOST_PTR_ALIGNMENT);
+#else
+		void* ptr = 0;
+		data_ = posix_memalign(&ptr, HOST_PTR_ALIGNMENT, bytes) ? 0 : (T*)ptr;
+#endif
+		if (!data_)
+			throw std::bad_alloc();
+		owned_ = true;
+		memset((char*)(data_ + n), 0, bytes - n * sizeof(T));
+	}
+
+	// use n elements at data without taking ownership, the memory must outlive the array
+	void Attach(T* data, size_t n) {
+		Free();
+		data_ = data;
+		size_ = capacity_ = n;
+	}
+
+	// number of valid elements, at most the allocated capacity
+	void SetSize(size_t n) { size_ = (n < capacity_) ? n : capacity_; }
+
+	T* data() { return data_; }
+	const T* data() const { return data_; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	T& operator[](size_t i) { return data_[i]; }
+	const T& operator[](size_t i) const { return data_[i]; }
+
+	// allocation size in bytes, rounded up so it can back a zero-copy buffer
+	size_t ByteSize() const {
+		size_t bytes = capacity_ * sizeof(T);
+		return (bytes + HOST_PTR_SIZE_MULTIPLE - 1) / HOST_PTR_SIZE_MULTIPLE * HOST_PTR_SIZE_MULTIPLE;
+	}
+
+private:
+	AlignedArray(const AlignedArray&);
+	AlignedArray& operator=(const AlignedArray&);
+
+	void Free() {
+		if (data_ && owned_) {
+#ifdef _WIN32
+			_aligned_free(data_);
+#else
+			free(data_);
+#endif
+		}
+		data_ = 0;
+		size_ = capacity_ = 0;
+		owned_ = false;
+	}
+
+	T* data_;
+	size_t size_;
+	size_t capacity_;
+	bool owned_;
+};
+
+typedef AlignedArray<float> AlignedFloatArray;
+
+// read-only memory mapping of a whole file
+// with copy_on_write the pages are also writable, changes stay private to the process and never reach the file
+// (some OpenCL runtimes expect to be able to write to CL_MEM_USE_HOST_PTR memory even for read-only buffers)
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& file_name, bool copy_on_write = false) : data_(0), size_(0) {
+#ifdef _WIN32
+		file_ = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		mapping_ = NULL;
+		if (file_ == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Could not open " + file_name);
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file_, &file_size);
+		size_ = (size_t)file_size.QuadPart;
+		if (size_) {
+			mapping_ = CreateFileMappingA(file_, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+			data_ = mapping_ ? (char*)MapViewOfFile(mapping_, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0) : 0;
+			if (!data_) {
+				Close();
+				throw std::runtime_error("Could not map " + file_name);
+			}
+		}
+#else
+		fd_ = open(file_name.c_str(), O_RDONLY);
+		if (fd_ < 0)
+			throw std::runtime_error("Could not open " + file_name);
+		struct stat st;
+		fstat(fd_, &st);
+		size_ = (size_t)st.st_size;
+		if (size_) {
+			void* ptr = mmap(0, size_, copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd_, 0);
+			if (ptr == MAP_FAILED) {
+				Close();
+				throw std::runtime_error("Could not map " + file_name);
+			}
+			data_ = (char*)ptr;
+			madvise(ptr, size_, MADV_SEQUENTIAL);
+		}
+#endif
+	}
+
+	~MappedFile() { Close(); }
+
+	const char* data() const { return data_; }
+	char* data() { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	void Close() {
+#ifdef _WIN32
+		if (data_) UnmapViewOfFile(data_);
+		if (mapping_) CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+		mapping_ = NULL;
+		file_ = INVALID_HANDLE_VALUE;
+#else
+		if (data_) munmap((void*)data_, size_);
+		if (fd_ >= 0) close(fd_);
+		fd_ = -1;
+#endif
+		data_ = 0;
+	}
+
+#ifdef _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int fd_;
+#endif
+	char* data_;
+	size_t size_;
+};
+
+// parse a decimal float from [begin, end) without needing a terminating null
+// short values like the temperatures ("-3.5", "17.0") take an exact fast path: the mantissa and the power of ten
+// are both exactly representable as floats, so a single float division rounds the same way std::stof does
+// anything longer falls back to strtof on a local copy
+inline bool ParseFloat(const char* begin, const char* end, float& value) {
+	const char* p = begin;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	unsigned long mantissa = 0;
+	int significant = 0, decimals = 0;
+	bool point = false, any_digit = false;
+	for (; p < end; p++) {
+		if (*p >= '0' && *p <= '9') {
+			// more than 7 significant digits could exceed 2^24, leave those to strtof
+			if (significant == 7)
+				break;
+			any_digit = true;
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) significant++;
+			if (point) decimals++;
+		}
+		else if (*p == '.' && !point) point = true;
+		else break;
+	}
+
+	// 10^10 is the largest power of ten a float holds exactly
+	static const float powers_of_ten[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	if (p == end && any_digit && decimals <= 10) {
+		float f = (float)mantissa / powers_of_ten[decimals];
+		value = negative ? -f : f;
+		return true;
+	}
+
+	char buffer[64];
+	size_t length = end - begin;
+	if (length == 0 || length >= sizeof(buffer))
+		return false;
+	memcpy(buffer, begin, length);
+	buffer[length] = 0;
+	char* parsed_end;
+	value = strtof(buffer, &parsed_end);
+	return parsed_end == buffer + length;
+}
+
+// parse a run of digits from [begin, end)
+inline bool ParseUnsigned(const char* begin, const char* end, unsigned& value) {
+	if (begin == end)
+		return false;
+	value = 0;
+	for (const char* p = begin; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			return false;
+		value = value * 10 + (*p - '0');
+	}
+	return true;
+}
+
+// year, month and day packed into one integer that still sorts chronologically
+inline uint32_t PackDate(unsigned year, unsigned month, unsigned day) { return (year << 16) | (month << 8) | day; }
+inline unsigned DateYear(uint32_t date) { return date >> 16; }
+inline unsigned DateMonth(uint32_t date) { return (date >> 8) & 0xFF; }
+inline unsigned DateDay(uint32_t date) { return date & 0xFF; }
+
+// station names seen while parsing, a record stores the index of its station in here
+struct StationDictionary {
+	std::vector<std::string> names;
+	size_t last;
+
+	StationDictionary() : last(0) {}
+
+	uint16_t Lookup(const char* begin, const char* end) {
+		// records come in long runs from the same station, so try the previous hit first
+		size_t length = end - begin;
+		if (last < names.size() && names[last].size() == length && !memcmp(names[last].data(), begin, length))
+			return (uint16_t)last;
+		for (last = 0; last < names.size(); last++) {
+			if (names[last].size() == length && !memcmp(names[last].data(), begin, length))
+				return (uint16_t)last;
+		}
+		if (names.size() > 0xFFFF)
+			throw std::runtime_error("Too many weather stations");
+		names.push_back(std::string(begin, end));
+		return (uint16_t)last;
+	}
+};
+
+// number of columns in a record: station, year, month, day, time (HHMM), temperature
+const int RECORD_COLUMNS = 6;
+
+// where the parser writes each column of a record
+struct RecordColumns {
+	uint16_t* station;
+	uint32_t* date;
+	uint16_t* time;
+	float* temperature;
+};
+
+// split one line into its columns and store record i, blank lines are skipped and return false
+inline bool ParseRecordLine(const char* line, const char* line_end, StationDictionary& stations, RecordColumns& out, size_t i) {
+	const char* column[RECORD_COLUMNS + 1];
+	const char* column_end[RECORD_COLUMNS + 1];
+	int columns = 0;
+
+	const char* p = line;
+	while (columns <= RECORD_COLUMNS) {
+		while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		if (p == line_end)
+			break;
+		column[columns] = p;
+		while (p < line_end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		column_end[columns++] = p;
+	}
+
+	if (!columns)
+		return false;
+
+	unsigned year, month, day, time;
+	if (columns != RECORD_COLUMNS ||
+		!ParseUnsigned(column[1], column_end[1], year) || !ParseUnsigned(column[2], column_end[2], month) ||
+		!ParseUnsigned(column[3], column_end[3], day) || !ParseUnsigned(column[4], column_end[4], time) ||
+		!ParseFloat(column[5], column_end[5], out.temperature[i]))
+		throw std::runtime_error("Malformed record: " + std::string(line, line_end));
+
+	out.station[i] = stations.Lookup(column[0], column_end[0]);
+	out.date[i] = PackDate(year, month, day);
+	out.time[i] = (uint16_t)time;
+	return true;
+}
+
+// parse every record in [begin, end) straight into the columns, returns the number of records written
+// the columns must have room for one record per line
+inline size_t ParseRecords(const char* begin, const char* end, StationDictionary& stations, RecordColumns out) {
+	size_t n = 0;
+	while (begin < end) {
+		const char* line_end = (const char*)memchr(begin, '\n', end - begin);
+		if (!line_end)
+			line_end = end;
+		if (ParseRecordLine(begin, line_end, stations, out, n))
+			n++;
+		begin = line_end + 1;
+	}
+	return n;
+}
+
+// upper bound on the number of records, used to preallocate the output
+inline size_t CountLines(const char* begin, const char* end) {
+	size_t lines = 0;
+	while (begin < end) {
+		const char* line_end = (const char*)memchr(begin, '\n', end - begin);
+		lines++;
+		if (!line_end)
+			break;
+		begin = line_end + 1;
+	}
+	return lines;
+}
+
+// files are split into chunks of about this size for the parser threads, smaller files are parsed on one thread
+const size_t PARSE_CHUNK_BYTES = 1 << 20;
+
+// split [begin, end) into at most pieces ranges of roughly equal size that each end on a line boundary
+// returns pieces + 1 boundaries, range i is [bounds[i], bounds[i + 1])
+inline std::vector<const char*> SplitAtLines(const char* begin, const char* end, size_t pieces) {
+	std::vector<const char*> bounds(pieces + 1, end);
+	bounds[0] = begin;
+	size_t size = end - begin;
+	for (size_t i = 1; i < pieces; i++) {
+		const char* p = begin + size / pieces * i;
+		if (p < bounds[i - 1])
+			p = bounds[i - 1];
+		const char* line_end = (const char*)memchr(p, '\n', end - p);
+		bounds[i] = line_end ? line_end + 1 : end;
+	}
+	return bounds;
+}
+
+// the station records in column form, each column is a page-aligned array that can back a device buffer
+// the columns either own their memory (parsed from text) or point into a mapped binary cache, which mapping keeps alive
+struct Dataset {
+	std::vector<std::string> stations; // station id -> station name
+	AlignedArray<uint16_t> station; // station id of every record
+	AlignedArray<uint32_t> date; // PackDate(year, month, day)
+	AlignedArray<uint16_t> time; // HHMM
+	AlignedArray<float> temperature; // degrees Celsius
+	std::shared_ptr<MappedFile> mapping;
+
+	size_t size() const { return temperature.size(); }
+	bool empty() const { return temperature.empty(); }
+};
+
+// parse the records in [begin, end) (whole lines) straight into page-aligned arrays
+// the text is split at line boundaries and the chunks are parsed in parallel on the thread pool:
+// every chunk counts its lines first, so each thread knows where its records go in the shared output columns
+inline void ParseDataset(const char* begin, const char* end, Dataset& out, ThreadPool& pool = DefaultThreadPool()) {
+	size_t chunks = std::min(pool.Size() * 4, (size_t)(end - begin) / PARSE_CHUNK_BYTES);
+	if (chunks < 1)
+		chunks = 1;
+	std::vector<const char*> bounds = SplitAtLines(begin, end, chunks);
+
+	std::vector<size_t> offsets(chunks + 1, 0);
+	std::vector<size_t> parsed(chunks, 0);
+	std::vector<StationDictionary> dictionaries(chunks);
+
+	pool.ParallelFor(chunks, [&](size_t c) {
+		offsets[c + 1] = CountLines(bounds[c], bounds[c + 1]);
+	});
+	for (size_t c = 0; c < chunks; c++)
+		offsets[c + 1] += offsets[c];
+
+	size_t lines = offsets[chunks];
+	out.mapping.reset();
+	out.station.Allocate(lines);
+	out.date.Allocate(lines);
+	out.time.Allocate(lines);
+	out.temperature.Allocate(lines);
+
+	pool.ParallelFor(chunks, [&](size_t c) {
+		RecordColumns columns = { out.station.data() + offsets[c], out.date.data() + offsets[c], out.time.data() + offsets[c], out.temperature.data() + offsets[c] };
+		parsed[c] = ParseRecords(bounds[c], bounds[c + 1], dictionaries[c], columns);
+	});
+
+	// every chunk numbered its stations on its own, merge them into one dictionary and renumber
+	StationDictionary merged;
+	std::vector<std::vector<uint16_t> > remap(chunks);
+	for (size_t c = 0; c < chunks; c++) {
+		for (size_t i = 0; i < dictionaries[c].names.size(); i++) {
+			const std::string& name = dictionaries[c].names[i];
+			remap[c].push_back(merged.Lookup(name.data(), name.data() + name.size()));
+		}
+	}
+	out.stations = merged.names;
+
+	pool.ParallelFor(chunks, [&](size_t c) {
+		uint16_t* station = out.station.data() + offsets[c];
+		for (size_t i = 0; i < parsed[c]; i++)
+			station[i] = remap[c][station[i]];
+	});
+
+	// blank lines leave a gap at the end of their chunk's slice, close those up (nothing moves for a clean file)
+	size_t n = parsed[0];
+	for (size_t c = 1; c < chunks; c++) {
+		if (offsets[c] != n) {
+			memmove(out.station.data() + n, out.station.data() + offsets[c], parsed[c] * sizeof(uint16_t));
+			memmove(out.date.data() + n, out.date.data() + offsets[c], parsed[c] * sizeof(uint32_t));
+			memmove(out.time.data() + n, out.time.data() + offsets[c], parsed[c] * sizeof(uint16_t));
+			memmove(out.temperature.data() + n, out.temperature.data() + offsets[c], parsed[c] * sizeof(float));
+		}
+		n += parsed[c];
+	}
+	out.station.SetSize(n);
+	out.date.SetSize(n);
+	out.time.SetSize(n);
+	out.temperature.SetSize(n);
+}
+
+// memory-map a text dataset and parse all of it
+inline void LoadDataset(const std::string& file_name, Dataset& out, ThreadPool& pool = DefaultThreadPool()) {
+	MappedFile file(file_name);
+	ParseDataset(file.data(), file.data() + file.size(), out, pool);
+}
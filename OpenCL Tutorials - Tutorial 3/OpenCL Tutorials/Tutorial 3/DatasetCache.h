@@ -0,0 +1,244 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Dataset.h"
+#include "Hash.h"
+
+// binary columnar cache of a parsed text dataset, written next to it as <file>.bin
+//
+// layout (little-endian):
+//   DatasetCacheHeader
+//   station dictionary: for every station a uint16 name length followed by the name
+//   station ids (uint16), dates (uint32, PackDate), times (uint16, HHMM), temperatures (float32)
+// every column starts on a page boundary and the file is padded to a whole page,
+// so the mapped columns can be handed straight to CL_MEM_USE_HOST_PTR buffers
+
+const char DATASET_CACHE_MAGIC[8] = { 'T', 'E', 'M', 'P', 'C', 'O', 'L', 0 };
+const uint32_t DATASET_CACHE_VERSION = 1;
+
+struct DatasetCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t stations; // dictionary entries
+	uint64_t records;
+	uint64_t file_size; // size of the whole cache file
+	// the text file the cache was built from
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	// byte offsets of each section from the start of the file
+	uint64_t dictionary_offset;
+	uint64_t station_offset;
+	uint64_t date_offset;
+	uint64_t time_offset;
+	uint64_t temperature_offset;
+};
+
+// identity of the source text file, compared against the cache header before the cache is trusted
+struct FileStamp {
+	uint64_t size;
+	int64_t mtime;
+	uint64_t hash;
+};
+
+// size and modification time from the file system, plus a hash of the first and last 64KB
+// hashing the whole file would cost as much as the parse the cache is there to skip
+inline bool GetFileStamp(const std::string& file_name, FileStamp& stamp) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(file_name.c_str(), &st))
+		return false;
+#else
+	struct stat st;
+	if (stat(file_name.c_str(), &st))
+		return false;
+#endif
+	stamp.size = (uint64_t)st.st_size;
+	stamp.mtime = (int64_t)st.st_mtime;
+
+	const size_t sample = 1 << 16;
+	std::vector<char> buffer(sample);
+	std::ifstream file(file_name, std::ios::binary);
+	file.read(&buffer[0], sample);
+	stamp.hash = Fnv1a(&buffer[0], (size_t)file.gcount());
+	if (stamp.size > sample) {
+		file.clear();
+		file.seekg(-(std::streamoff)std::min<uint64_t>(sample, stamp.size - sample), std::ios::end);
+		file.read(&buffer[0], sample);
+		stamp.hash = Fnv1a(&buffer[0], (size_t)file.gcount(), stamp.hash);
+	}
+	return true;
+}
+
+inline uint64_t AlignToPage(uint64_t offset) {
+	return (offset + HOST_PTR_ALIGNMENT - 1) / HOST_PTR_ALIGNMENT * HOST_PTR_ALIGNMENT;
+}
+
+// write data as the cache file, going through a temporary file so a half-written cache is never picked up
+inline bool WriteDatasetCache(const std::string& cache_name, const Dataset& data, const FileStamp& source) {
+	DatasetCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic));
+	header.version = DATASET_CACHE_VERSION;
+	header.stations = (uint32_t)data.stations.size();
+	header.records = data.size();
+	header.source_size = source.size;
+	header.source_mtime = source.mtime;
+	header.source_hash = source.hash;
+
+	std::string dictionary;
+	for (size_t i = 0; i < data.stations.size(); i++) {
+		uint16_t length = (uint16_t)data.stations[i].size();
+		dictionary.append((const char*)&length, sizeof(length));
+		dictionary.append(data.stations[i]);
+	}
+
+	header.dictionary_offset = sizeof(header);
+	header.station_offset = AlignToPage(header.dictionary_offset + dictionary.size());
+	header.date_offset = AlignToPage(header.station_offset + header.records * sizeof(uint16_t));
+	header.time_offset = AlignToPage(header.date_offset + header.records * sizeof(uint32_t));
+	header.temperature_offset = AlignToPage(header.time_offset + header.records * sizeof(uint16_t));
+	header.file_size = AlignToPage(header.temperature_offset + header.records * sizeof(float));
+
+	std::string temp_name = cache_name + ".tmp";
+	{
+		std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+
+		std::vector<char> padding(HOST_PTR_ALIGNMENT, 0);
+		uint64_t written = 0;
+		// write a section at its offset, padding the gap before it with zeros
+		auto section = [&](uint64_t offset, const void* bytes, uint64_t size) {
+			file.write(&padding[0], (std::streamsize)(offset - written));
+			file.write((const char*)bytes, (std::streamsize)size);
+			written = offset + size;
+		};
+
+		section(0, &header, sizeof(header));
+		section(header.dictionary_offset, dictionary.data(), dictionary.size());
+		section(header.station_offset, data.station.data(), header.records * sizeof(uint16_t));
+		section(header.date_offset, data.date.data(), header.records * sizeof(uint32_t));
+		section(header.time_offset, data.time.data(), header.records * sizeof(uint16_t));
+		section(header.temperature_offset, data.temperature.data(), header.records * sizeof(float));
+		section(header.file_size, 0, 0);
+
+		if (!file)
+			return false;
+	}
+
+	remove(cache_name.c_str());
+	if (rename(temp_name.c_str(), cache_name.c_str())) {
+		remove(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+// a section of size bytes at offset, starting at or after end (the end of the section before it), on a page boundary
+// if aligned and inside the file; moves end past it
+inline bool CacheSectionFits(uint64_t offset, uint64_t size, bool aligned, uint64_t file_size, uint64_t& end) {
+	if (offset < end || offset > file_size || size > file_size - offset || (aligned && offset % HOST_PTR_ALIGNMENT))
+		return false;
+	end = offset + size;
+	return true;
+}
+
+// map the cache file and point the dataset's columns into it
+// returns false if there is no cache, or it is from another version or another state of the source file, or if it
+// is truncated or corrupt (a section outside the file or out of order, a station id outside the dictionary), so the
+// cache gets rebuilt instead of read out of bounds
+inline bool OpenDatasetCache(const std::string& cache_name, const FileStamp& source, Dataset& out) {
+	std::shared_ptr<MappedFile> mapping;
+	try {
+		mapping.reset(new MappedFile(cache_name, true));
+	}
+	catch (const std::runtime_error&) {
+		return false;
+	}
+
+	if (mapping->size() < sizeof(DatasetCacheHeader))
+		return false;
+	DatasetCacheHeader header;
+	memcpy(&header, mapping->data(), sizeof(header));
+
+	if (memcmp(header.magic, DATASET_CACHE_MAGIC, sizeof(header.magic)) || header.version != DATASET_CACHE_VERSION ||
+		header.file_size != mapping->size() || header.source_size != source.size ||
+		header.source_mtime != source.mtime || header.source_hash != source.hash)
+		return false;
+
+	// every section in the order WriteDatasetCache lays them out (the dictionary ends where the station ids start),
+	// the record count bounded first so the column sizes cannot overflow
+	uint64_t end = sizeof(header);
+	if (header.records > header.file_size ||
+		!CacheSectionFits(header.dictionary_offset, 0, false, header.file_size, end) ||
+		!CacheSectionFits(header.station_offset, header.records * sizeof(uint16_t), true, header.file_size, end) ||
+		!CacheSectionFits(header.date_offset, header.records * sizeof(uint32_t), true, header.file_size, end) ||
+		!CacheSectionFits(header.time_offset, header.records * sizeof(uint16_t), true, header.file_size, end) ||
+		!CacheSectionFits(header.temperature_offset, header.records * sizeof(float), true, header.file_size, end))
+		return false;
+
+	char* base = mapping->data();
+	size_t records = (size_t)header.records;
+
+	std::vector<std::string> stations;
+	const char* p = base + header.dictionary_offset;
+	const char* dictionary_end = base + header.station_offset;
+	for (uint32_t i = 0; i < header.stations; i++) {
+		uint16_t length;
+		if ((size_t)(dictionary_end - p) < sizeof(length))
+			return false;
+		memcpy(&length, p, sizeof(length));
+		p += sizeof(length);
+		if ((size_t)(dictionary_end - p) < length)
+			return false;
+		stations.push_back(std::string(p, length));
+		p += length;
+	}
+
+	// every station id has to name a dictionary entry, the rest of the program indexes the dictionary with them
+	const uint16_t* station = (const uint16_t*)(base + header.station_offset);
+	for (size_t i = 0; i < records; i++)
+		if (station[i] >= header.stations)
+			return false;
+
+	out.stations.swap(stations);
+	out.station.Attach((uint16_t*)(base + header.station_offset), records);
+	out.date.Attach((uint32_t*)(base + header.date_offset), records);
+	out.time.Attach((uint16_t*)(base + header.time_offset), records);
+	out.temperature.Attach((float*)(base + header.temperature_offset), records);
+	out.mapping = mapping;
+	return true;
+}
+
+inline std::string DatasetCacheName(const std::string& file_name) {
+	return file_name + ".bin";
+}
+
+// load a text dataset through its binary cache
+// a valid cache is mapped directly, otherwise the text is parsed and a new cache is written for the next run
+// returns true if the cache was used
+inline bool LoadDatasetCached(const std::string& file_name, Dataset& out, ThreadPool& pool = DefaultThreadPool()) {
+	FileStamp source;
+	if (!GetFileStamp(file_name, source))
+		throw std::runtime_error("Could not open " + file_name);
+
+	std::string cache_name = DatasetCacheName(file_name);
+	if (OpenDatasetCache(cache_name, source, out))
+		return true;
+
+	LoadDataset(file_name, out, pool);
+	if (!WriteDatasetCache(cache_name, out, source))
+		std::cerr << "Could not write the dataset cache " << cache_name << std::endl;
+	return false;
+}
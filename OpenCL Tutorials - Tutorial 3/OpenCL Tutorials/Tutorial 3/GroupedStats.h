@@ -0,0 +1,170 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Reduction.h"
+#include "Dataset.h"
+#include "BufferPool.h"
+
+// group key of a record: the whole 16-bit station id at bit 32, then the year (16 bits) and the month (8 bits), the
+// same fields PackDate keeps, so no station, year or month is ever cut short and merged with another
+// must match group_key in my_kernels3.cl
+inline uint64_t GroupKey(unsigned station, unsigned year, unsigned month) { return ((uint64_t)station << 32) | (year << 8) | month; }
+inline unsigned GroupKeyStation(uint64_t key) { return (unsigned)(key >> 32); }
+inline unsigned GroupKeyYear(uint64_t key) { return (unsigned)(key >> 8) & 0xFFFF; }
+inline unsigned GroupKeyMonth(uint64_t key) { return (unsigned)key & 0xFF; }
+
+// which columns a grouped report is broken down by
+enum GroupBy {
+	GROUP_STATION = 1,
+	GROUP_YEAR = 2,
+	GROUP_MONTH = 4
+};
+
+// one row of a grouped report, ALL_GROUPS in a column means the row covers every value of it
+const int ALL_GROUPS = -1;
+
+struct GroupRow {
+	int station;
+	int year;
+	int month;
+	StatsSummary stats;
+};
+
+// statistics for every station/year/month group in one device pass
+// grouped_stats emits one partial per run of equal keys, the runs are read back and merged by key here
+// returns the rows sorted by station, year and month; the key and run buffers are borrowed from pool
+inline std::vector<GroupRow> ComputeGroupedStats(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	Dataset& data, size_t local_size, std::vector<cl::Event>& events) {
+
+	std::vector<GroupRow> rows;
+	size_t elements = data.size();
+	if (!elements)
+		return rows;
+
+	cl::Kernel kernel(program, "grouped_stats");
+	// grouped_stats keeps three arrays in local memory, so it may not reach the workgroup size of the plain reduction
+	local_size = std::min(local_size, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context.getInfo<CL_CONTEXT_DEVICES>()[0]));
+	size_t nr_groups = GroupCount(elements, local_size);
+
+	// the columns are page-aligned, so the device can use them in place
+	cl::Buffer buffer_station(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.station.ByteSize(), data.station.data());
+	cl::Buffer buffer_date(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.date.ByteSize(), data.date.data());
+	cl::Buffer buffer_temperature(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.temperature.ByteSize(), data.temperature.data());
+
+	// at most one run per record
+	PooledBuffer buffer_keys = pool.Acquire(elements * sizeof(cl_ulong), CL_MEM_WRITE_ONLY);
+	PooledBuffer buffer_runs = pool.Acquire(elements * sizeof(StatsPartial), CL_MEM_WRITE_ONLY);
+	PooledBuffer buffer_count = pool.Acquire(sizeof(cl_uint));
+
+	kernel.setArg(0, buffer_station);
+	kernel.setArg(1, buffer_date);
+	kernel.setArg(2, buffer_temperature);
+	kernel.setArg(3, buffer_keys.Buffer());
+	kernel.setArg(4, buffer_runs.Buffer());
+	kernel.setArg(5, buffer_count.Buffer());
+	kernel.setArg(6, (cl_uint)elements);
+	kernel.setArg(7, cl::Local(local_size * sizeof(cl_ulong)));
+	kernel.setArg(8, cl::Local(local_size * sizeof(StatsPartial)));
+	kernel.setArg(9, cl::Local(local_size * sizeof(cl_uint)));
+
+	cl::Event fill_event, kernel_event, read_event;
+	queue.enqueueFillBuffer(buffer_count, (cl_uint)0, 0, sizeof(cl_uint), NULL, &fill_event);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+	cl_uint runs = 0;
+	queue.enqueueReadBuffer(buffer_count, CL_TRUE, 0, sizeof(cl_uint), &runs, NULL, &read_event);
+	events.push_back(fill_event);
+	events.push_back(kernel_event);
+	events.push_back(read_event);
+
+	std::vector<cl_ulong> keys(runs);
+	std::vector<StatsPartial> partials(runs);
+	if (runs) {
+		cl::Event keys_event, partials_event;
+		queue.enqueueReadBuffer(buffer_keys, CL_FALSE, 0, runs * sizeof(cl_ulong), &keys[0], NULL, &keys_event);
+		queue.enqueueReadBuffer(buffer_runs, CL_TRUE, 0, runs * sizeof(StatsPartial), &partials[0], NULL, &partials_event);
+		events.push_back(keys_event);
+		events.push_back(partials_event);
+	}
+
+	// runs of the same group (split across workgroups, or from unsorted input) are merged here
+	std::map<uint64_t, StatsSummary> groups;
+	for (size_t i = 0; i < runs; i++)
+		CombineStats(groups[keys[i]], partials[i]);
+
+	for (std::map<uint64_t, StatsSummary>::const_iterator it = groups.begin(); it != groups.end(); ++it) {
+		GroupRow row;
+		row.station = GroupKeyStation(it->first);
+		row.year = GroupKeyYear(it->first);
+		row.month = GroupKeyMonth(it->first);
+		row.stats = it->second;
+		rows.push_back(row);
+	}
+	return rows;
+}
+
+// roll station/year/month rows up to a coarser breakdown (any combination of GroupBy flags) by merging partials
+inline std::vector<GroupRow> RollUpGroups(const std::vector<GroupRow>& rows, int group_by) {
+	std::map<std::vector<int>, GroupRow> merged;
+	for (size_t i = 0; i < rows.size(); i++) {
+		GroupRow row = rows[i];
+		if (!(group_by & GROUP_STATION)) row.station = ALL_GROUPS;
+		if (!(group_by & GROUP_YEAR)) row.year = ALL_GROUPS;
+		if (!(group_by & GROUP_MONTH)) row.month = ALL_GROUPS;
+
+		std::vector<int> key(3);
+		key[0] = row.station;
+		key[1] = row.year;
+		key[2] = row.month;
+
+		std::map<std::vector<int>, GroupRow>::iterator it = merged.find(key);
+		if (it == merged.end())
+			merged[key] = row;
+		else
+			CombineStats(it->second.stats, row.stats);
+	}
+
+	std::vector<GroupRow> result;
+	for (std::map<std::vector<int>, GroupRow>::const_iterator it = merged.begin(); it != merged.end(); ++it)
+		result.push_back(it->second);
+	return result;
+}
+
+// parse a breakdown like "station,year" into GroupBy flags
+inline int ParseGroupBy(const std::string& spec) {
+	int group_by = 0;
+	if (spec.find("station") != std::string::npos) group_by |= GROUP_STATION;
+	if (spec.find("year") != std::string::npos) group_by |= GROUP_YEAR;
+	if (spec.find("month") != std::string::npos) group_by |= GROUP_MONTH;
+	return group_by;
+}
+
+// print grouped rows as a table, station ids are resolved through the dataset's dictionary
+inline void PrintGroupTable(std::ostream& out, const std::vector<GroupRow>& rows, const std::vector<std::string>& stations) {
+	std::streamsize precision = out.precision();
+	out << std::left << std::setw(16) << "Station" << std::right << std::setw(6) << "Year" << std::setw(6) << "Month"
+		<< std::setw(10) << "Count" << std::setw(10) << "Min" << std::setw(10) << "Max" << std::setw(10) << "Avg" << std::setw(10) << "StdDev" << std::endl;
+
+	for (size_t i = 0; i < rows.size(); i++) {
+		const GroupRow& row = rows[i];
+		out << std::left << std::setw(16) << ((row.station == ALL_GROUPS) ? std::string("*") : stations[row.station]) << std::right;
+		if (row.year == ALL_GROUPS) out << std::setw(6) << "*"; else out << std::setw(6) << row.year;
+		if (row.month == ALL_GROUPS) out << std::setw(6) << "*"; else out << std::setw(6) << row.month;
+		out << std::setw(10) << row.stats.count << std::fixed << std::setprecision(2)
+			<< std::setw(10) << row.stats.min << std::setw(10) << row.stats.max
+			<< std::setw(10) << row.stats.mean << std::setw(10) << row.stats.StdDev() << std::endl;
+		out.unsetf(std::ios::fixed);
+	}
+	out.precision(precision);
+}
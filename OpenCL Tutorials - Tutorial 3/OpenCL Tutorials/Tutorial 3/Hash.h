@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, chained through hash to cover several pieces
+// used to fingerprint source files, program sources and file prefixes, not for anything adversarial
+inline uint64_t Fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
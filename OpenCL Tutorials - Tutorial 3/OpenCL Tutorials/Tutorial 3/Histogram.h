@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "BufferPool.h"
+
+// equal-width bins over [lo, hi)
+struct Histogram {
+	double lo;
+	double hi;
+	std::vector<cl_uint> counts;
+
+	double BinWidth() const { return (hi - lo) / counts.size(); }
+	double BinStart(size_t b) const { return lo + b * BinWidth(); }
+
+	unsigned long long Total() const {
+		unsigned long long total = 0;
+		for (size_t b = 0; b < counts.size(); b++)
+			total += counts[b];
+		return total;
+	}
+
+	// approximate percentile, interpolated linearly inside the bin that holds it
+	// the error is at most one bin width
+	double Percentile(double percentile) const {
+		unsigned long long total = Total();
+		if (!total)
+			return lo;
+		double target = total * std::min(100.0, std::max(0.0, percentile)) / 100.0;
+		double seen = 0;
+		for (size_t b = 0; b < counts.size(); b++) {
+			if (counts[b] && seen + counts[b] >= target)
+				return BinStart(b) + BinWidth() * (target - seen) / counts[b];
+			seen += counts[b];
+		}
+		return hi;
+	}
+};
+
+// histogram of n floats from a device buffer into bins equal-width bins over [lo, hi)
+// lo and hi usually come from a previous min/max pass, values outside them are clamped into the end bins
+// the bins are privatized per workgroup in local memory, so bins is limited by CL_DEVICE_LOCAL_MEM_SIZE
+inline Histogram ComputeHistogram(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& input, size_t n, double lo, double hi, size_t bins, std::vector<cl::Event>& events) {
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	if (!bins || bins * sizeof(cl_uint) > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+		throw std::runtime_error("Histogram bin count must be between 1 and what fits in local memory");
+
+	Histogram histogram;
+	histogram.lo = lo;
+	// a single value (min == max) still gets a bin of non-zero width
+	histogram.hi = (hi > lo) ? hi : lo + 1;
+	histogram.counts.assign(bins, 0);
+	if (!n)
+		return histogram;
+
+	cl::Kernel kernel(program, "histogram");
+	size_t local_size = std::min<size_t>(256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	// a few workgroups per compute unit, each one strides over the input
+	size_t nr_groups = std::min<size_t>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4, (n + local_size - 1) / local_size);
+
+	PooledBuffer buffer_H = pool.Acquire(bins * sizeof(cl_uint));
+
+	kernel.setArg(0, input);
+	kernel.setArg(1, (cl_uint)n);
+	kernel.setArg(2, (cl_float)histogram.lo);
+	kernel.setArg(3, (cl_float)(bins / (histogram.hi - histogram.lo)));
+	kernel.setArg(4, (cl_uint)bins);
+	kernel.setArg(5, buffer_H.Buffer());
+	kernel.setArg(6, cl::Local(bins * sizeof(cl_uint)));
+
+	cl::Event fill_event, kernel_event, read_event;
+	queue.enqueueFillBuffer(buffer_H, (cl_uint)0, 0, bins * sizeof(cl_uint), NULL, &fill_event);
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+	queue.enqueueReadBuffer(buffer_H, CL_TRUE, 0, bins * sizeof(cl_uint), &histogram.counts[0], NULL, &read_event);
+	events.push_back(fill_event);
+	events.push_back(kernel_event);
+	events.push_back(read_event);
+
+	return histogram;
+}
+
+// print the bins with a bar scaled to the fullest one
+inline void PrintHistogram(std::ostream& out, const Histogram& histogram, size_t bar_width = 50) {
+	cl_uint largest = histogram.counts.empty() ? 0 : *std::max_element(histogram.counts.begin(), histogram.counts.end());
+	for (size_t b = 0; b < histogram.counts.size(); b++) {
+		size_t bar = largest ? (size_t)((double)histogram.counts[b] * bar_width / largest) : 0;
+		out << "[" << std::setw(8) << histogram.BinStart(b) << ", " << std::setw(8) << histogram.BinStart(b + 1) << ") "
+			<< std::setw(10) << histogram.counts[b] << " " << std::string(bar, '#') << std::endl;
+	}
+}
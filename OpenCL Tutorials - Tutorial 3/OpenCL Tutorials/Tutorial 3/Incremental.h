@@ -0,0 +1,228 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include "Stats.h"
+#include "Dataset.h"
+#include "Hash.h"
+#include "GroupedStats.h"
+
+// append-only statistics: running aggregates per station/year/month group, kept next to the text dataset as
+// <file>.stats together with the byte offset of the text they cover, so a refresh parses and reduces only the
+// lines appended since
+//
+// layout (little-endian): IncrementalStateHeader, the station dictionary (uint16 name length and the name, in id
+// order), then one IncrementalGroup per group
+// the state is only trusted for a file that still starts with the text it was built from (the hash of its first
+// INCREMENTAL_PREFIX_BYTES, or up to the offset if that is shorter, matches); a rewritten or truncated file is reduced
+// from the start again, but an edit past the hashed prefix that keeps the file as long is not noticed
+
+const char INCREMENTAL_MAGIC[8] = { 'T', 'E', 'M', 'P', 'I', 'N', 'C', 0 };
+// 2: 64-bit group keys, see GroupKey
+const uint32_t INCREMENTAL_VERSION = 2;
+
+// bytes at the start of the file that identify it, hashed into the state
+const size_t INCREMENTAL_PREFIX_BYTES = 1 << 16;
+
+struct IncrementalStateHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t stations;
+	uint64_t groups;
+	uint64_t offset;      // text up to here (a line boundary) is in the aggregates
+	uint64_t records;     // records in the aggregates
+	uint64_t prefix_hash; // Fnv1a of the first min(offset, INCREMENTAL_PREFIX_BYTES) bytes
+};
+
+// one group's aggregate as stored in the state file
+struct IncrementalGroup {
+	uint64_t key; // GroupKey over the state's station ids
+	uint64_t count;
+	double min;
+	double max;
+	double mean;
+	double m2;
+};
+
+struct IncrementalState {
+	std::vector<std::string> stations;     // station id -> name, ids only ever get added
+	std::map<uint64_t, StatsSummary> groups;
+	uint64_t offset;
+	uint64_t records;
+	uint64_t prefix_hash;
+
+	IncrementalState() : offset(0), records(0), prefix_hash(0) {}
+};
+
+// what a refresh did
+struct IncrementalUpdate {
+	uint64_t bytes;      // newly parsed text
+	uint64_t records;    // newly reduced records
+	bool restarted;      // the state didn't match the file and everything was reduced again
+};
+
+// reduces the records of a dataset to station/year/month rows, e.g. ComputeGroupedStats on a device
+typedef std::function<std::vector<GroupRow>(Dataset&)> GroupReducer;
+
+inline std::string IncrementalStateName(const std::string& file_name) {
+	return file_name + ".stats";
+}
+
+// the same rows as ComputeGroupedStats, on the host
+inline std::vector<GroupRow> HostGroupedStats(Dataset& data) {
+	std::map<uint64_t, StatsSummary> groups;
+	for (size_t i = 0; i < data.size(); i++) {
+		StatsSummary one;
+		float value = data.temperature[i];
+		CombineStats(one, value, value, 1, value, 0);
+		CombineStats(groups[GroupKey(data.station[i], DateYear(data.date[i]), DateMonth(data.date[i]))], one);
+	}
+
+	std::vector<GroupRow> rows;
+	for (std::map<uint64_t, StatsSummary>::const_iterator it = groups.begin(); it != groups.end(); ++it) {
+		GroupRow row = { (int)GroupKeyStation(it->first), (int)GroupKeyYear(it->first), (int)GroupKeyMonth(it->first), it->second };
+		rows.push_back(row);
+	}
+	return rows;
+}
+
+// false (and an empty state) if there is no usable state file, e.g. one with a group of a station past its dictionary
+inline bool ReadIncrementalState(const std::string& state_name, IncrementalState& state) {
+	state = IncrementalState();
+	std::ifstream file(state_name, std::ios::binary);
+	IncrementalStateHeader header;
+	if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic)) ||
+		header.version != INCREMENTAL_VERSION)
+		return false;
+
+	IncrementalState loaded;
+	for (uint32_t i = 0; i < header.stations; i++) {
+		uint16_t length = 0;
+		if (!file.read((char*)&length, sizeof(length)))
+			return false;
+		std::string name(length, 0);
+		if (length && !file.read(&name[0], length))
+			return false;
+		loaded.stations.push_back(name);
+	}
+	for (uint64_t i = 0; i < header.groups; i++) {
+		IncrementalGroup group;
+		if (!file.read((char*)&group, sizeof(group)) || GroupKeyStation(group.key) >= header.stations)
+			return false;
+		StatsSummary& stats = loaded.groups[group.key];
+		stats.count = group.count;
+		stats.min = group.min;
+		stats.max = group.max;
+		stats.mean = group.mean;
+		stats.m2 = group.m2;
+	}
+	loaded.offset = header.offset;
+	loaded.records = header.records;
+	loaded.prefix_hash = header.prefix_hash;
+	state = loaded;
+	return true;
+}
+
+// write the state through a temporary file, so an interrupted refresh keeps the previous state
+inline bool WriteIncrementalState(const std::string& state_name, const IncrementalState& state) {
+	IncrementalStateHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic));
+	header.version = INCREMENTAL_VERSION;
+	header.stations = (uint32_t)state.stations.size();
+	header.groups = state.groups.size();
+	header.offset = state.offset;
+	header.records = state.records;
+	header.prefix_hash = state.prefix_hash;
+
+	std::string temp_name = state_name + ".tmp";
+	{
+		std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+		file.write((const char*)&header, sizeof(header));
+		for (size_t i = 0; i < state.stations.size(); i++) {
+			uint16_t length = (uint16_t)state.stations[i].size();
+			file.write((const char*)&length, sizeof(length));
+			file.write(state.stations[i].data(), length);
+		}
+		for (std::map<uint64_t, StatsSummary>::const_iterator it = state.groups.begin(); it != state.groups.end(); ++it) {
+			IncrementalGroup group = { it->first, it->second.count, it->second.min, it->second.max, it->second.mean, it->second.m2 };
+			file.write((const char*)&group, sizeof(group));
+		}
+		if (!file)
+			return false;
+	}
+
+	remove(state_name.c_str());
+	if (rename(temp_name.c_str(), state_name.c_str())) {
+		remove(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+// bring the state of a text dataset up to date: only the complete lines appended since the last refresh are parsed,
+// reduced with reduce and merged into the running aggregates, then the state is written back
+// a trailing line without its newline is left for the next refresh, since it may still be being written
+inline IncrementalUpdate UpdateIncrementalStats(const std::string& file_name, IncrementalState& state, const GroupReducer& reduce = HostGroupedStats) {
+	std::string state_name = IncrementalStateName(file_name);
+	IncrementalUpdate update = { 0, 0, false };
+
+	MappedFile file(file_name);
+	const char* text = file.data();
+	uint64_t size = file.size();
+
+	bool loaded = ReadIncrementalState(state_name, state);
+	if (loaded && (state.offset > size || Fnv1a(text, (size_t)std::min<uint64_t>(state.offset, INCREMENTAL_PREFIX_BYTES)) != state.prefix_hash)) {
+		state = IncrementalState();
+		update.restarted = true;
+	}
+
+	// up to the end of the last complete line
+	uint64_t end = size;
+	while (end > state.offset && text[end - 1] != '\n')
+		end--;
+	if (end == state.offset)
+		return update;
+
+	Dataset appended;
+	ParseDataset(text + state.offset, text + end, appended);
+
+	// the new lines numbered their stations on their own, renumber them into the state's dictionary
+	StationDictionary dictionary;
+	dictionary.names = state.stations;
+	std::vector<uint16_t> remap;
+	for (size_t i = 0; i < appended.stations.size(); i++)
+		remap.push_back(dictionary.Lookup(appended.stations[i].data(), appended.stations[i].data() + appended.stations[i].size()));
+	state.stations = dictionary.names;
+
+	std::vector<GroupRow> rows = reduce(appended);
+	for (size_t i = 0; i < rows.size(); i++)
+		CombineStats(state.groups[GroupKey(remap[rows[i].station], rows[i].year, rows[i].month)], rows[i].stats);
+
+	update.bytes = end - state.offset;
+	update.records = appended.size();
+	state.records += appended.size();
+	state.offset = end;
+	state.prefix_hash = Fnv1a(text, (size_t)std::min<uint64_t>(state.offset, INCREMENTAL_PREFIX_BYTES));
+
+	if (!WriteIncrementalState(state_name, state))
+		std::cerr << "Could not write the incremental state " << state_name << std::endl;
+	return update;
+}
+
+// the aggregates as station/year/month rows, ready for RollUpGroups and PrintGroupTable
+inline std::vector<GroupRow> IncrementalRows(const IncrementalState& state) {
+	std::vector<GroupRow> rows;
+	for (std::map<uint64_t, StatsSummary>::const_iterator it = state.groups.begin(); it != state.groups.end(); ++it) {
+		GroupRow row = { (int)GroupKeyStation(it->first), (int)GroupKeyYear(it->first), (int)GroupKeyMonth(it->first), it->second };
+		rows.push_back(row);
+	}
+	return rows;
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Reduction.h"
+#include "ProgramCache.h"
+#include "Dataset.h"
+#include "Parallel.h"
+#include "NativeStats.h"
+#include "BufferPool.h"
+
+// statistics of one dataset split across several workers: every device of a platform plus optional host threads
+//
+// the input is cut into fixed-size chunks and every worker starts with a contiguous run of them, sized in proportion
+// to the throughput it reached in the previous call (equal runs the first time); a worker that runs out steals the
+// back half of the biggest run left, so a badly guessed split only costs a few chunks at the end
+// each worker merges its own chunk results and those are merged once at the end
+
+// elements per chunk, a multiple of HOST_PTR_ALIGNMENT so chunks of aligned data can be used in place
+const size_t DEFAULT_SPLIT_CHUNK_ELEMENTS = 4 << 20;
+
+// chunks each device has in flight, so its thread can queue the next one while the last is still running
+const size_t SPLIT_DEVICE_DEPTH = 2;
+
+// every device of a platform
+inline std::vector<cl::Device> PlatformDevices(int platform_id) {
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	if (platform_id < 0 || (size_t)platform_id >= platforms.size())
+		throw std::runtime_error("There is no such platform");
+
+	std::vector<cl::Device> devices;
+	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+	return devices;
+}
+
+// how one worker did in the last call
+struct SplitWorkerReport {
+	std::string name;
+	size_t chunks;
+	size_t stolen;      // chunks it took from other workers' runs
+	size_t elements;
+	double seconds;     // from the start of the call until it ran out of work
+	double throughput;  // elements per second, used to size its run in the next call
+};
+
+class SplitStats {
+public:
+	// kernels are built (through the program cache) for every device; host_threads adds that many host workers
+	SplitStats(const std::vector<cl::Device>& devices, const cl::Program::Sources& sources, size_t host_threads,
+		size_t chunk_elements = DEFAULT_SPLIT_CHUNK_ELEMENTS) {
+
+		size_t alignment = HOST_PTR_ALIGNMENT / sizeof(float);
+		chunk_elements_ = std::max(alignment, (chunk_elements + alignment - 1) / alignment * alignment);
+
+		for (size_t i = 0; i < devices.size(); i++) {
+			lanes_.push_back(DeviceLane());
+			DeviceLane& lane = lanes_.back();
+			lane.context = cl::Context(std::vector<cl::Device>(1, devices[i]));
+			lane.device = devices[i];
+			lane.queue = cl::CommandQueue(lane.context, CL_QUEUE_PROFILING_ENABLE);
+			lane.program = BuildProgramCached(lane.context, sources);
+			lane.first_pass = cl::Kernel(lane.program, "fused_stats");
+			lane.merge_pass = cl::Kernel(lane.program, "merge_stats_partials");
+			lane.local_size = FloorPowerOfTwo(std::min<size_t>(256, std::min(lane.first_pass.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[i]),
+				lane.merge_pass.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[i]))));
+			lane.max_alloc = (size_t)devices[i].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			lane.base_align = std::max<size_t>(1, devices[i].getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8);
+
+			// every lane has its own context, so its own pool
+			lane.pool.reset(new BufferPool(lane.context));
+			size_t partials_size = PartialsBufferSize(chunk_elements_, lane.local_size);
+			lane.slots.resize(SPLIT_DEVICE_DEPTH);
+			for (size_t s = 0; s < lane.slots.size(); s++) {
+				lane.slots[s].input = lane.pool->Acquire(chunk_elements_ * sizeof(float), CL_MEM_READ_ONLY);
+				lane.slots[s].ping = lane.pool->Acquire(partials_size);
+				lane.slots[s].pong = lane.pool->Acquire(partials_size);
+			}
+
+			SplitWorkerReport report = { devices[i].getInfo<CL_DEVICE_NAME>(), 0, 0, 0, 0, 0 };
+			reports_.push_back(report);
+		}
+		for (size_t i = 0; i < host_threads; i++) {
+			SplitWorkerReport report = { "host thread " + std::to_string(i), 0, 0, 0, 0, 0 };
+			reports_.push_back(report);
+		}
+		if (reports_.empty())
+			throw std::runtime_error("A split needs at least one device or host thread");
+
+		runs_ = std::vector<ChunkRun>(reports_.size());
+		pool_.reset(new ThreadPool(reports_.size()));
+	}
+
+	size_t ChunkElements() const { return chunk_elements_; }
+	const std::vector<SplitWorkerReport>& Reports() const { return reports_; }
+
+	// commands of the last call on every device, for profiling
+	std::vector<cl::Event> Events() const {
+		std::vector<cl::Event> events;
+		for (size_t i = 0; i < lanes_.size(); i++)
+			events.insert(events.end(), lanes_[i].events.begin(), lanes_[i].events.end());
+		return events;
+	}
+
+	StatsSummary Compute(const float* data, size_t n) {
+		StatsSummary total;
+		if (!n)
+			return total;
+
+		size_t chunks = (n + chunk_elements_ - 1) / chunk_elements_;
+		Split(chunks);
+
+		std::vector<StatsSummary> results(reports_.size());
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		pool_->ParallelFor(reports_.size(), [&](size_t w) {
+			SplitWorkerReport& report = reports_[w];
+			report.chunks = report.stolen = report.elements = 0;
+			if (w < lanes_.size())
+				RunDevice(lanes_[w], w, data, n, results[w]);
+			else
+				RunHost(w, data, n, results[w]);
+			report.seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::high_resolution_clock::now() - start).count();
+		});
+
+		for (size_t w = 0; w < reports_.size(); w++) {
+			CombineStats(total, results[w]);
+			// a worker that got no chunks keeps its old estimate
+			if (reports_[w].elements && reports_[w].seconds > 0)
+				reports_[w].throughput = reports_[w].elements / reports_[w].seconds;
+		}
+		return total;
+	}
+
+private:
+	SplitStats(const SplitStats&);
+	SplitStats& operator=(const SplitStats&);
+
+	struct DeviceSlot {
+		PooledBuffer input;
+		cl::Buffer in_place; // keeps the sub-buffer of the chunk in flight alive
+		PooledBuffer ping;
+		PooledBuffer pong;
+		StatsPartial result;
+		cl::Event done;
+		bool busy;
+	};
+
+	struct DeviceLane {
+		cl::Context context;
+		cl::Device device;
+		cl::CommandQueue queue;
+		cl::Program program;
+		cl::Kernel first_pass;
+		cl::Kernel merge_pass;
+		size_t local_size;
+		size_t max_alloc;
+		size_t base_align;  // bytes, sub-buffers have to start on a multiple of it
+		std::unique_ptr<BufferPool> pool; // before slots, so the slots give their buffers back first
+		std::vector<DeviceSlot> slots;
+		cl::Buffer whole;   // zero-copy buffer over the whole input of the current call
+		std::vector<cl::Event> events;
+	};
+
+	// the chunks [next, end) a worker still has to do; the owner takes from the front, thieves from the back
+	struct ChunkRun {
+		std::mutex mutex;
+		size_t next;
+		size_t end;
+
+		ChunkRun() : next(0), end(0) {}
+		ChunkRun(const ChunkRun&) : next(0), end(0) {}
+	};
+
+	// hand out contiguous runs of chunks in proportion to the measured throughputs
+	void Split(size_t chunks) {
+		double total_rate = 0;
+		bool measured = true;
+		for (size_t w = 0; w < reports_.size(); w++) {
+			total_rate += reports_[w].throughput;
+			measured = measured && reports_[w].throughput > 0;
+		}
+
+		size_t first = 0;
+		double share = 0;
+		for (size_t w = 0; w < reports_.size(); w++) {
+			share += measured ? reports_[w].throughput / total_rate : 1.0 / reports_.size();
+			size_t last = (w + 1 == reports_.size()) ? chunks : std::min(chunks, (size_t)(share * chunks + 0.5));
+			runs_[w].next = first;
+			runs_[w].end = std::max(first, last);
+			first = runs_[w].end;
+		}
+	}
+
+	// next chunk for worker w, from its own run or stolen; false once there is nothing left anywhere
+	bool NextChunk(size_t w, size_t& chunk) {
+		{
+			std::lock_guard<std::mutex> lock(runs_[w].mutex);
+			if (runs_[w].next < runs_[w].end) {
+				chunk = runs_[w].next++;
+				return true;
+			}
+		}
+
+		for (;;) {
+			// the victim with the most chunks left, its count may be stale by the time it is locked
+			size_t victim = runs_.size(), most = 0;
+			for (size_t v = 0; v < runs_.size(); v++) {
+				std::lock_guard<std::mutex> lock(runs_[v].mutex);
+				if (runs_[v].end - runs_[v].next > most) {
+					most = runs_[v].end - runs_[v].next;
+					victim = v;
+				}
+			}
+			if (victim == runs_.size())
+				return false;
+
+			size_t stolen_first, stolen_end;
+			{
+				std::lock_guard<std::mutex> lock(runs_[victim].mutex);
+				size_t left = runs_[victim].end - runs_[victim].next;
+				if (!left)
+					continue;
+				stolen_end = runs_[victim].end;
+				stolen_first = stolen_end - (left + 1) / 2;
+				runs_[victim].end = stolen_first;
+			}
+
+			std::lock_guard<std::mutex> lock(runs_[w].mutex);
+			runs_[w].next = stolen_first + 1;
+			runs_[w].end = stolen_end;
+			reports_[w].stolen += stolen_end - stolen_first;
+			chunk = stolen_first;
+			return true;
+		}
+	}
+
+	void RunHost(size_t w, const float* data, size_t n, StatsSummary& result) {
+		size_t chunk;
+		while (NextChunk(w, chunk)) {
+			size_t offset = chunk * chunk_elements_;
+			size_t count = std::min(chunk_elements_, n - offset);
+			CombineStats(result, NativeChunkStats(data + offset, count));
+			reports_[w].chunks++;
+			reports_[w].elements += count;
+		}
+	}
+
+	void RunDevice(DeviceLane& lane, size_t w, const float* data, size_t n, StatsSummary& result) {
+		lane.events.clear();
+		for (size_t s = 0; s < lane.slots.size(); s++)
+			lane.slots[s].busy = false;
+
+		// aligned input is used in place, which is what a CPU device wants: one zero-copy buffer over all of it per
+		// call, every chunk a sub-buffer of it, rather than a buffer of its own per chunk
+		lane.whole = cl::Buffer();
+		if (!((uintptr_t)data % HOST_PTR_ALIGNMENT) && n * sizeof(float) <= lane.max_alloc)
+			lane.whole = cl::Buffer(lane.context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, n * sizeof(float), (void*)data);
+
+		size_t chunk, k = 0;
+		while (NextChunk(w, chunk)) {
+			DeviceSlot& slot = lane.slots[k++ % lane.slots.size()];
+			if (slot.busy) {
+				slot.done.wait();
+				CombineStats(result, slot.result);
+			}
+
+			size_t offset = chunk * chunk_elements_;
+			size_t count = std::min(chunk_elements_, n - offset);
+
+			// chunks of the zero-copy buffer are used in place, others are uploaded into the slot
+			const cl::Buffer* input = &slot.input.Buffer();
+			std::vector<cl::Event> uploaded;
+			if (lane.whole() && !(offset * sizeof(float) % lane.base_align)) {
+				cl_buffer_region region = { offset * sizeof(float), count * sizeof(float) };
+				slot.in_place = lane.whole.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region);
+				input = &slot.in_place;
+			}
+			else {
+				uploaded.resize(1);
+				lane.queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, count * sizeof(float), data + offset, NULL, &uploaded[0]);
+				lane.events.push_back(uploaded[0]);
+			}
+
+			slot.done = EnqueueReduceStats(lane.queue, lane.first_pass, lane.merge_pass, *input, count, slot.ping, slot.pong, lane.local_size,
+				&slot.result, lane.events, uploaded.empty() ? NULL : &uploaded);
+			slot.busy = true;
+			lane.queue.flush();
+
+			reports_[w].chunks++;
+			reports_[w].elements += count;
+		}
+
+		for (size_t s = 0; s < lane.slots.size(); s++) {
+			if (lane.slots[s].busy) {
+				lane.slots[s].done.wait();
+				CombineStats(result, lane.slots[s].result);
+			}
+			lane.slots[s].in_place = cl::Buffer();
+		}
+		lane.whole = cl::Buffer();
+	}
+
+	size_t chunk_elements_;
+	std::vector<DeviceLane> lanes_;
+	std::vector<SplitWorkerReport> reports_;
+	std::vector<ChunkRun> runs_;
+	std::unique_ptr<ThreadPool> pool_;
+};
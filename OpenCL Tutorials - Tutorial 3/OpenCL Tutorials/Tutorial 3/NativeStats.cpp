@@ -0,0 +1,60 @@
+#include "NativeStats.h"
+
+#include <sstream>
+
+#include "Percentiles.h"
+
+namespace {
+
+double HostMedian(const float* data, size_t n) {
+	std::vector<double> median(1, 50.0);
+	std::vector<size_t> ranks = PercentileRanks(median, n);
+	std::vector<float> values = SelectRanksOnHost(data, n, ranks);
+	return InterpolatePercentiles(median, n, ranks, values)[0];
+}
+
+StatsSummary BlockedStats(const float* data, size_t n) {
+	StatsSummary total;
+	for (size_t offset = 0; offset < n; offset += NATIVE_BLOCK_ELEMENTS)
+		CombineStats(total, NativeChunkStats(data + offset, std::min(NATIVE_BLOCK_ELEMENTS, n - offset)));
+	return total;
+}
+
+}
+
+StatsResult NativeStats::Compute(const float* data, size_t n, int mask) {
+	StatsResult result;
+	if (!n)
+		return result;
+
+	size_t blocks = (n + NATIVE_BLOCK_ELEMENTS - 1) / NATIVE_BLOCK_ELEMENTS;
+	std::vector<StatsSummary> partials(blocks);
+	pool_.ParallelFor(blocks, [&](size_t b) {
+		size_t offset = b * NATIVE_BLOCK_ELEMENTS;
+		partials[b] = NativeChunkStats(data + offset, std::min(NATIVE_BLOCK_ELEMENTS, n - offset));
+	});
+	for (size_t b = 0; b < blocks; b++)
+		CombineStats(result.summary, partials[b]);
+
+	if (mask & STATS_MEDIAN)
+		result.median = HostMedian(data, n);
+	return result;
+}
+
+std::vector<StatsResult> NativeStats::ComputeMany(const std::vector<FloatSpan>& spans, int mask) {
+	std::vector<StatsResult> results(spans.size());
+	pool_.ParallelFor(spans.size(), [&](size_t i) {
+		if (!spans[i].size)
+			return;
+		results[i].summary = BlockedStats(spans[i].data, spans[i].size);
+		if (mask & STATS_MEDIAN)
+			results[i].median = HostMedian(spans[i].data, spans[i].size);
+	});
+	return results;
+}
+
+std::string NativeStats::Name() const {
+	std::stringstream name;
+	name << "native, " << pool_.Size() << " threads, " << NativeSimdName();
+	return name.str();
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NATIVE_SSE2
+#endif
+
+#include "Stats.h"
+#include "StatsEngine.h"
+#include "Parallel.h"
+
+// elements per task of the native backend, small enough to balance across threads and to keep the shifted sums
+// of a block exact in double
+const size_t NATIVE_BLOCK_ELEMENTS = 1 << 18;
+
+// instruction set the native statistics were compiled for (/arch:AVX2 or -mavx2 and up pick the wider paths)
+inline const char* NativeSimdName() {
+#if defined(__AVX512F__)
+	return "AVX-512";
+#elif defined(__AVX2__)
+	return "AVX2";
+#elif defined(NATIVE_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+// statistics of a block on one thread: min and max in float vectors, sums shifted by the first element in double
+// vectors (each float widened before the subtraction, so nothing is lost), variance from the shifted sums
+inline StatsSummary NativeChunkStats(const float* data, size_t n) {
+	StatsSummary stats;
+	if (!n)
+		return stats;
+
+	float lo = data[0], hi = data[0];
+	double shift = data[0], sum = 0, squares = 0;
+	size_t i = 0;
+
+#if defined(__AVX512F__)
+	__m512 vmin = _mm512_set1_ps(lo), vmax = vmin;
+	__m512d vshift = _mm512_set1_pd(shift), sum0 = _mm512_setzero_pd(), sum1 = sum0, sq0 = sum0, sq1 = sum0;
+	for (; i + 16 <= n; i += 16) {
+		__m512 x = _mm512_loadu_ps(data + i);
+		vmin = _mm512_min_ps(vmin, x);
+		vmax = _mm512_max_ps(vmax, x);
+		__m512d d0 = _mm512_sub_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(x)), vshift);
+		__m512d d1 = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(x), 1))), vshift);
+		sum0 = _mm512_add_pd(sum0, d0);
+		sum1 = _mm512_add_pd(sum1, d1);
+		sq0 = _mm512_fmadd_pd(d0, d0, sq0);
+		sq1 = _mm512_fmadd_pd(d1, d1, sq1);
+	}
+	lo = _mm512_reduce_min_ps(vmin);
+	hi = _mm512_reduce_max_ps(vmax);
+	sum = _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+	squares = _mm512_reduce_add_pd(_mm512_add_pd(sq0, sq1));
+#elif defined(__AVX2__)
+	__m256 vmin = _mm256_set1_ps(lo), vmax = vmin;
+	__m256d vshift = _mm256_set1_pd(shift), sum0 = _mm256_setzero_pd(), sum1 = sum0, sq0 = sum0, sq1 = sum0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(data + i);
+		vmin = _mm256_min_ps(vmin, x);
+		vmax = _mm256_max_ps(vmax, x);
+		__m256d d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), vshift);
+		__m256d d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), vshift);
+		sum0 = _mm256_add_pd(sum0, d0);
+		sum1 = _mm256_add_pd(sum1, d1);
+		sq0 = _mm256_add_pd(sq0, _mm256_mul_pd(d0, d0));
+		sq1 = _mm256_add_pd(sq1, _mm256_mul_pd(d1, d1));
+	}
+	float lanes[8];
+	double sums[4], sqs[4];
+	_mm256_storeu_ps(lanes, vmin);
+	lo = *std::min_element(lanes, lanes + 8);
+	_mm256_storeu_ps(lanes, vmax);
+	hi = *std::max_element(lanes, lanes + 8);
+	_mm256_storeu_pd(sums, _mm256_add_pd(sum0, sum1));
+	_mm256_storeu_pd(sqs, _mm256_add_pd(sq0, sq1));
+	sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+	squares = (sqs[0] + sqs[1]) + (sqs[2] + sqs[3]);
+#elif defined(NATIVE_SSE2)
+	__m128 vmin = _mm_set1_ps(lo), vmax = vmin;
+	__m128d vshift = _mm_set1_pd(shift), sum0 = _mm_setzero_pd(), sum1 = sum0, sq0 = sum0, sq1 = sum0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(data + i);
+		vmin = _mm_min_ps(vmin, x);
+		vmax = _mm_max_ps(vmax, x);
+		__m128d d0 = _mm_sub_pd(_mm_cvtps_pd(x), vshift);
+		__m128d d1 = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), vshift);
+		sum0 = _mm_add_pd(sum0, d0);
+		sum1 = _mm_add_pd(sum1, d1);
+		sq0 = _mm_add_pd(sq0, _mm_mul_pd(d0, d0));
+		sq1 = _mm_add_pd(sq1, _mm_mul_pd(d1, d1));
+	}
+	float lanes[4];
+	double sums[2], sqs[2];
+	_mm_storeu_ps(lanes, vmin);
+	lo = *std::min_element(lanes, lanes + 4);
+	_mm_storeu_ps(lanes, vmax);
+	hi = *std::max_element(lanes, lanes + 4);
+	_mm_storeu_pd(sums, _mm_add_pd(sum0, sum1));
+	_mm_storeu_pd(sqs, _mm_add_pd(sq0, sq1));
+	sum = sums[0] + sums[1];
+	squares = sqs[0] + sqs[1];
+#endif
+
+	for (; i < n; i++) {
+		double d = data[i] - shift;
+		sum += d;
+		squares += d * d;
+		lo = std::min(lo, data[i]);
+		hi = std::max(hi, data[i]);
+	}
+
+	stats.min = lo;
+	stats.max = hi;
+	stats.count = n;
+	stats.mean = shift + sum / n;
+	stats.m2 = std::max(0.0, squares - sum * (sum / n));
+	return stats;
+}
+
+// the statistics on the host's cores, for machines without an OpenCL device and for datasets too small to be worth
+// a transfer; blocks of NATIVE_BLOCK_ELEMENTS are reduced in parallel and merged in order, so results don't depend
+// on the thread count
+class NativeStats : public StatsBackend {
+public:
+	// threads = 0 uses one thread per hardware core
+	explicit NativeStats(size_t threads = 0) : pool_(threads) {}
+
+	StatsResult Compute(const float* data, size_t n, int mask = STATS_BASIC);
+	std::vector<StatsResult> ComputeMany(const std::vector<FloatSpan>& spans, int mask = STATS_BASIC);
+	std::string Name() const;
+
+	size_t Threads() const { return pool_.Size(); }
+
+private:
+	ThreadPool pool_;
+};
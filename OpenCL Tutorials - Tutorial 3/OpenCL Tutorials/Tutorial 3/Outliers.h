@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Dataset.h"
+#include "GroupedStats.h"
+#include "BufferPool.h"
+#include "Scan.h"
+
+// months per station in the outlier tables, must match OUTLIER_MONTHS in my_kernels3.cl
+const size_t OUTLIER_MONTHS = 12;
+
+// mean and standard deviation of every station and calendar month, at station * OUTLIER_MONTHS + month - 1
+// a group without records (or with one) gets a standard deviation of 0, which flag_outliers never flags
+struct OutlierTables {
+	std::vector<cl_float> mean;
+	std::vector<cl_float> stddev;
+
+	// z-score of a value in a station's month, 0 where the group has no spread
+	double ZScore(unsigned station, unsigned month, float value) const {
+		size_t g = station * OUTLIER_MONTHS + month - 1;
+		return stddev[g] > 0 ? (value - mean[g]) / stddev[g] : 0;
+	}
+};
+
+// the tables from station/year/month rows (e.g. ComputeGroupedStats), merged over the years
+inline OutlierTables BuildOutlierTables(const std::vector<GroupRow>& rows, size_t stations) {
+	OutlierTables tables;
+	tables.mean.assign(stations * OUTLIER_MONTHS, 0);
+	tables.stddev.assign(stations * OUTLIER_MONTHS, 0);
+
+	std::vector<GroupRow> months = RollUpGroups(rows, GROUP_STATION | GROUP_MONTH);
+	for (size_t i = 0; i < months.size(); i++) {
+		const GroupRow& row = months[i];
+		if (row.station < 0 || (size_t)row.station >= stations || row.month < 1 || row.month > (int)OUTLIER_MONTHS)
+			continue;
+		size_t g = row.station * OUTLIER_MONTHS + row.month - 1;
+		tables.mean[g] = (cl_float)row.stats.mean;
+		tables.stddev[g] = (cl_float)row.stats.StdDev();
+	}
+	return tables;
+}
+
+// records beyond the threshold, in file order, with their z-scores
+struct OutlierReport {
+	std::vector<cl_uint> records;
+	std::vector<double> z;
+};
+
+// records further than threshold standard deviations from the mean of their station and calendar month
+// flag_outliers writes a 0/1 flag per record (and a 0 after the last), ScanCountsOnDevice turns the flags into slots in
+// place and compact_outliers writes every flagged index to its slot, so the host reads back the outlier count (the
+// last slot) and the outliers only, never a value per record
+// the z-scores of the outliers are recomputed from the tables on the host
+inline OutlierReport FindOutliersOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	Dataset& data, const OutlierTables& tables, double threshold, std::vector<cl::Event>& events) {
+
+	OutlierReport report;
+	size_t n = data.size();
+	if (!n)
+		return report;
+	if (!(threshold > 0))
+		throw std::runtime_error("The outlier threshold has to be positive");
+
+	// the columns are page-aligned, so the device can use them in place
+	cl::Buffer buffer_station(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.station.ByteSize(), data.station.data());
+	cl::Buffer buffer_date(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.date.ByteSize(), data.date.data());
+	cl::Buffer buffer_temperature(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, data.temperature.ByteSize(), data.temperature.data());
+
+	size_t table_bytes = tables.mean.size() * sizeof(cl_float);
+	PooledBuffer buffer_mean = pool.Acquire(table_bytes, CL_MEM_READ_ONLY);
+	PooledBuffer buffer_stddev = pool.Acquire(table_bytes, CL_MEM_READ_ONLY);
+	cl::Event write_events[2];
+	queue.enqueueWriteBuffer(buffer_mean, CL_FALSE, 0, table_bytes, &tables.mean[0], NULL, &write_events[0]);
+	queue.enqueueWriteBuffer(buffer_stddev, CL_FALSE, 0, table_bytes, &tables.stddev[0], NULL, &write_events[1]);
+	events.insert(events.end(), write_events, write_events + 2);
+
+	PooledBuffer buffer_flags = pool.Acquire((n + 1) * sizeof(cl_uint));
+	cl::Kernel flag(program, "flag_outliers");
+	flag.setArg(0, buffer_station);
+	flag.setArg(1, buffer_date);
+	flag.setArg(2, buffer_temperature);
+	flag.setArg(3, buffer_mean.Buffer());
+	flag.setArg(4, buffer_stddev.Buffer());
+	flag.setArg(5, (cl_uint)n);
+	flag.setArg(6, (cl_float)threshold);
+	flag.setArg(7, buffer_flags.Buffer());
+	cl::Event flag_event;
+	queue.enqueueNDRangeKernel(flag, cl::NullRange, cl::NDRange(n + 1), cl::NullRange, NULL, &flag_event);
+	events.push_back(flag_event);
+
+	ScanCountsOnDevice(queue, program, pool, buffer_flags, n + 1, CountScanLocalSize(context, program), events);
+
+	PooledBuffer buffer_indices = pool.Acquire(n * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+	cl::Kernel compact(program, "compact_outliers");
+	compact.setArg(0, buffer_flags.Buffer());
+	compact.setArg(1, (cl_uint)n);
+	compact.setArg(2, buffer_indices.Buffer());
+	cl_uint total = 0;
+	cl::Event compact_event, total_event;
+	queue.enqueueNDRangeKernel(compact, cl::NullRange, cl::NDRange(n), cl::NullRange, NULL, &compact_event);
+	queue.enqueueReadBuffer(buffer_flags, CL_TRUE, n * sizeof(cl_uint), sizeof(cl_uint), &total, NULL, &total_event);
+	events.push_back(compact_event);
+	events.push_back(total_event);
+
+	report.records.resize(total);
+	if (total) {
+		cl::Event read_event;
+		queue.enqueueReadBuffer(buffer_indices, CL_TRUE, 0, total * sizeof(cl_uint), &report.records[0], NULL, &read_event);
+		events.push_back(read_event);
+	}
+
+	for (size_t i = 0; i < report.records.size(); i++) {
+		cl_uint record = report.records[i];
+		report.z.push_back(tables.ZScore(data.station[record], DateMonth(data.date[record]), data.temperature[record]));
+	}
+	return report;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+// fixed set of worker threads that run indexed tasks
+// the calling thread joins in, so a pool of size 1 runs everything inline
+class ThreadPool {
+public:
+	// threads = 0 uses one thread per hardware core
+	explicit ThreadPool(size_t threads = 0) : stop_(false), generation_(0), task_(0), count_(0), active_(0) {
+		if (!threads)
+			threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+		for (size_t i = 1; i < threads; i++)
+			workers_.push_back(std::thread(&ThreadPool::Worker, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for (size_t i = 0; i < workers_.size(); i++)
+			workers_[i].join();
+	}
+
+	size_t Size() const { return workers_.size() + 1; }
+
+	// run task(i) for every i in [0, count) and return once all of them are done
+	// tasks are handed out dynamically, so uneven tasks balance across the threads
+	// the first exception thrown by a task is rethrown here; tasks must not call ParallelFor on the same pool
+	void ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+		if (!count)
+			return;
+
+		std::lock_guard<std::mutex> one_job(job_mutex_);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			task_ = &task;
+			count_ = count;
+			next_ = 0;
+			error_ = std::exception_ptr();
+			active_ = workers_.size();
+			generation_++;
+		}
+		wake_.notify_all();
+
+		RunTasks();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (active_)
+			done_.wait(lock);
+		task_ = 0;
+		if (error_)
+			std::rethrow_exception(error_);
+	}
+
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void Worker() {
+		size_t seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				while (!stop_ && generation_ == seen)
+					wake_.wait(lock);
+				if (stop_)
+					return;
+				seen = generation_;
+			}
+
+			RunTasks();
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (--active_ == 0)
+				done_.notify_one();
+		}
+	}
+
+	void RunTasks() {
+		for (;;) {
+			size_t i = next_++;
+			if (i >= count_)
+				break;
+			try {
+				(*task_)(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!error_)
+					error_ = std::current_exception();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers_;
+	std::mutex job_mutex_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	bool stop_;
+	size_t generation_;
+	const std::function<void(size_t)>* task_;
+	size_t count_;
+	std::atomic<size_t> next_;
+	size_t active_;
+	std::exception_ptr error_;
+};
+
+// process-wide pool shared by the parser and the host-side reductions
+inline ThreadPool& DefaultThreadPool() {
+	static ThreadPool pool;
+	return pool;
+}
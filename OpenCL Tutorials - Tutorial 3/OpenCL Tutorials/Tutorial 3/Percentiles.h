@@ -0,0 +1,225 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Utils.h"
+#include "Reduction.h"
+#include "BufferPool.h"
+
+// bins per radix select pass, must match RADIX_BINS in my_kernels3.cl
+const size_t RADIX_BINS = 256;
+
+// queries handled by one radix_select_count launch, bounded by the local memory their bins need
+const size_t MAX_SELECT_QUERIES = 8;
+
+// host versions of float_key in my_kernels3.cl and its inverse
+inline cl_uint FloatKey(float f) {
+	cl_uint u;
+	memcpy(&u, &f, sizeof(u));
+	return u ^ ((u >> 31) ? 0xFFFFFFFF : 0x80000000);
+}
+
+inline float KeyToFloat(cl_uint key) {
+	cl_uint u = key ^ ((key >> 31) ? 0x80000000 : 0xFFFFFFFF);
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+// parse a list of percentiles like "25,50,75"
+inline std::vector<double> ParsePercentiles(const std::string& spec) {
+	return ParseNumberList(spec);
+}
+
+// a percentile interpolates linearly between the order statistics at floor(h) and floor(h) + 1, h = (n - 1) * p / 100
+// (the same definition as numpy's default and R's type 7)
+inline double PercentilePosition(double percentile, size_t n) {
+	double p = std::min(100.0, std::max(0.0, percentile));
+	return (n - 1) * p / 100.0;
+}
+
+// 0-based ranks of the order statistics needed for the percentiles, sorted and without repeats
+inline std::vector<size_t> PercentileRanks(const std::vector<double>& percentiles, size_t n) {
+	std::vector<size_t> ranks;
+	for (size_t i = 0; i < percentiles.size(); i++) {
+		double h = PercentilePosition(percentiles[i], n);
+		size_t lo = (size_t)std::floor(h);
+		ranks.push_back(lo);
+		ranks.push_back(std::min(lo + 1, n - 1));
+	}
+	std::sort(ranks.begin(), ranks.end());
+	ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+	return ranks;
+}
+
+// interpolate the percentiles from the values at PercentileRanks
+inline std::vector<double> InterpolatePercentiles(const std::vector<double>& percentiles, size_t n, const std::vector<size_t>& ranks, const std::vector<float>& values) {
+	std::vector<double> result;
+	for (size_t i = 0; i < percentiles.size(); i++) {
+		double h = PercentilePosition(percentiles[i], n);
+		size_t lo = (size_t)std::floor(h);
+		size_t hi = std::min(lo + 1, n - 1);
+		double a = values[std::lower_bound(ranks.begin(), ranks.end(), lo) - ranks.begin()];
+		double b = values[std::lower_bound(ranks.begin(), ranks.end(), hi) - ranks.begin()];
+		result.push_back(a + (h - lo) * (b - a));
+	}
+	return result;
+}
+
+// exact selection of the given ranks without sorting
+// radix select over the float keys: each pass fixes the next 8 bits of every query's key by counting the candidates
+// that still match in 256 bins, so four passes over the data find any number of ranks (in batches of MAX_SELECT_QUERIES)
+inline std::vector<float> SelectRanksOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& input, size_t n, const std::vector<size_t>& ranks, std::vector<cl::Event>& events) {
+
+	std::vector<float> values(ranks.size());
+	if (!n)
+		return values;
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::Kernel kernel(program, "radix_select_count");
+	size_t local_size = FloorPowerOfTwo(std::min<size_t>(256, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)));
+	// a few workgroups per compute unit, each one strides over the input
+	size_t nr_groups = std::min<size_t>(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4, (n + local_size - 1) / local_size);
+
+	PooledBuffer buffer_prefixes = pool.Acquire(MAX_SELECT_QUERIES * sizeof(cl_uint), CL_MEM_READ_ONLY);
+	PooledBuffer buffer_bins = pool.Acquire(MAX_SELECT_QUERIES * RADIX_BINS * sizeof(cl_uint));
+
+	for (size_t first = 0; first < ranks.size(); first += MAX_SELECT_QUERIES) {
+		size_t queries = std::min(MAX_SELECT_QUERIES, ranks.size() - first);
+		std::vector<cl_uint> prefixes(queries, 0);
+		std::vector<size_t> remaining(ranks.begin() + first, ranks.begin() + first + queries);
+		std::vector<cl_uint> bins(queries * RADIX_BINS);
+
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			cl::Event write_event, fill_event, kernel_event, read_event;
+			queue.enqueueWriteBuffer(buffer_prefixes, CL_FALSE, 0, queries * sizeof(cl_uint), &prefixes[0], NULL, &write_event);
+			queue.enqueueFillBuffer(buffer_bins, (cl_uint)0, 0, queries * RADIX_BINS * sizeof(cl_uint), NULL, &fill_event);
+
+			kernel.setArg(0, input);
+			kernel.setArg(1, (cl_uint)n);
+			kernel.setArg(2, buffer_prefixes.Buffer());
+			kernel.setArg(3, (cl_uint)queries);
+			kernel.setArg(4, (cl_uint)shift);
+			kernel.setArg(5, buffer_bins.Buffer());
+			kernel.setArg(6, cl::Local(queries * RADIX_BINS * sizeof(cl_uint)));
+			queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+			queue.enqueueReadBuffer(buffer_bins, CL_TRUE, 0, queries * RADIX_BINS * sizeof(cl_uint), &bins[0], NULL, &read_event);
+
+			events.push_back(write_event);
+			events.push_back(fill_event);
+			events.push_back(kernel_event);
+			events.push_back(read_event);
+
+			// the rank falls in the first digit whose cumulative count passes it
+			for (size_t q = 0; q < queries; q++) {
+				const cl_uint* counts = &bins[q * RADIX_BINS];
+				size_t digit = 0;
+				while (digit < RADIX_BINS - 1 && remaining[q] >= counts[digit]) {
+					remaining[q] -= counts[digit];
+					digit++;
+				}
+				prefixes[q] |= (cl_uint)digit << shift;
+			}
+		}
+
+		for (size_t q = 0; q < queries; q++)
+			values[first + q] = KeyToFloat(prefixes[q]);
+	}
+
+	return values;
+}
+
+// full bitonic sort on the device
+// the input is copied into a power-of-two buffer padded with +INFINITY, which sorts to the end; returns that buffer,
+// borrowed from pool
+inline PooledBuffer SortOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& input, size_t n, std::vector<cl::Event>& events) {
+
+	size_t padded = 2;
+	while (padded < n)
+		padded *= 2;
+
+	PooledBuffer sorted = pool.Acquire(padded * sizeof(cl_float));
+	cl::Event copy_event, fill_event;
+	if (n)
+		queue.enqueueCopyBuffer(input, sorted, 0, 0, n * sizeof(cl_float), NULL, &copy_event);
+	if (padded > n)
+		queue.enqueueFillBuffer(sorted, (cl_float)INFINITY, n * sizeof(cl_float), (padded - n) * sizeof(cl_float), NULL, &fill_event);
+	if (n)
+		events.push_back(copy_event);
+	if (padded > n)
+		events.push_back(fill_event);
+
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl::Kernel sort_local(program, "bitonic_sort_local");
+	cl::Kernel merge_global(program, "bitonic_merge_global");
+	cl::Kernel merge_local(program, "bitonic_merge_local");
+
+	// every work-item handles a pair, so a workgroup covers a tile of 2L elements
+	size_t L = FloorPowerOfTwo(std::min<size_t>(std::min<size_t>(256, padded / 2),
+		std::min(sort_local.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device), merge_local.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))));
+	cl::NDRange global(padded / 2), local(L);
+
+	cl::Event event;
+	sort_local.setArg(0, sorted.Buffer());
+	sort_local.setArg(1, cl::Local(2 * L * sizeof(cl_float)));
+	queue.enqueueNDRangeKernel(sort_local, cl::NullRange, global, local, NULL, &event);
+	events.push_back(event);
+
+	merge_local.setArg(0, sorted.Buffer());
+	merge_local.setArg(2, cl::Local(2 * L * sizeof(cl_float)));
+	merge_global.setArg(0, sorted.Buffer());
+
+	for (size_t k = 4 * L; k <= padded; k *= 2) {
+		// steps whose pairs span tiles run one launch each
+		for (size_t j = k / 2; j >= 2 * L; j /= 2) {
+			merge_global.setArg(1, (cl_uint)j);
+			merge_global.setArg(2, (cl_uint)k);
+			queue.enqueueNDRangeKernel(merge_global, cl::NullRange, global, cl::NullRange, NULL, &event);
+			events.push_back(event);
+		}
+		// the rest of the stage stays inside each tile
+		merge_local.setArg(1, (cl_uint)k);
+		queue.enqueueNDRangeKernel(merge_local, cl::NullRange, global, local, NULL, &event);
+		events.push_back(event);
+	}
+
+	return sorted;
+}
+
+// read single elements of a device buffer
+inline std::vector<float> ReadRanks(cl::CommandQueue& queue, const cl::Buffer& buffer, const std::vector<size_t>& ranks, std::vector<cl::Event>& events) {
+	std::vector<float> values(ranks.size());
+	for (size_t i = 0; i < ranks.size(); i++) {
+		cl::Event event;
+		queue.enqueueReadBuffer(buffer, CL_FALSE, ranks[i] * sizeof(cl_float), sizeof(cl_float), &values[i], NULL, &event);
+		events.push_back(event);
+	}
+	queue.finish();
+	return values;
+}
+
+// host baseline: std::nth_element on a copy of the data for every rank, each search narrowed by the one before
+inline std::vector<float> SelectRanksOnHost(const float* data, size_t n, const std::vector<size_t>& ranks) {
+	std::vector<float> copy(data, data + n);
+	std::vector<float> values(ranks.size());
+	std::vector<float>::iterator begin = copy.begin();
+	for (size_t i = 0; i < ranks.size(); i++) {
+		std::nth_element(begin, copy.begin() + ranks[i], copy.end());
+		values[i] = copy[ranks[i]];
+		begin = copy.begin() + ranks[i];
+	}
+	return values;
+}
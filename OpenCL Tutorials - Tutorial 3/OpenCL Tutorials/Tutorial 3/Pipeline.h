@@ -0,0 +1,251 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <chrono>
+#include <cstring>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Reduction.h"
+#include "Dataset.h"
+#include "Utils.h"
+#include "BufferPool.h"
+
+// text parsed per pipeline chunk
+const size_t PIPELINE_CHUNK_BYTES = 16 << 20;
+
+// chunks in flight: one being parsed into its staging buffer, one uploading, one reducing
+const size_t PIPELINE_DEPTH = 3;
+
+// the shortest line a record can have (six one-character columns, each followed by a separator or the newline),
+// which bounds the records of a chunk and so the size of its staging buffer
+const size_t MIN_RECORD_BYTES = 2 * RECORD_COLUMNS;
+
+// where the time of a pipelined run went, the device times are summed over the chunks
+struct PipelineTiming {
+	size_t chunks;
+	size_t records;
+	double parse_ms;    // producer thread, host clock
+	double transfer_ms; // unmaps and staging to device copies
+	double compute_ms;  // reduction kernels
+	double total_ms;    // end to end, from mapping the file to the merged result
+};
+
+// buffers of one chunk in flight
+// the staging buffer is pinned host memory (CL_MEM_ALLOC_HOST_PTR), mapped for the producer to fill and unmapped
+// for the copy to the device; host tells the producer where to write once mapped has completed (NULL while unmapped)
+struct PipelineSlot {
+	PooledBuffer staging;
+	PooledBuffer input;
+	PooledBuffer ping;
+	PooledBuffer pong;
+	float* host;
+	cl::Event mapped;
+	size_t count;
+	StatsPartial result;
+	cl::Event done;   // read-back of result
+	bool busy;        // a reduction of this slot's input is in flight
+	bool writable;    // mapped again (or about to be), the producer may fill it
+};
+
+// statistics of a text dataset with parsing, upload and reduction overlapped
+// a producer thread parses the file chunk by chunk (each chunk in parallel on the thread pool) straight into the
+// mapped staging buffer of a free slot; the calling thread unmaps it, copies it to the device on transfer_queue and
+// reduces it on compute_queue, each command waiting on the previous one's event rather than on the host, then maps
+// the staging buffer again without blocking once the copy is done
+// so while chunk k is parsed, chunk k - 1 crosses the bus and chunk k - 2 is reduced, and the end-to-end time
+// approaches the slowest of the three stages instead of their sum
+// local_size is asked for once, with the first chunk's values; the buffers are borrowed from pool
+inline StatsSummary PipelineStats(BufferPool& pool, cl::CommandQueue& transfer_queue, cl::CommandQueue& compute_queue,
+	cl::Kernel& first_pass, cl::Kernel& merge_pass, const std::string& file_name,
+	const std::function<size_t(const float*, size_t)>& local_size_for, PipelineTiming& timing, std::vector<cl::Event>& events,
+	size_t chunk_bytes = PIPELINE_CHUNK_BYTES) {
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	StatsSummary total;
+	memset(&timing, 0, sizeof(timing));
+
+	MappedFile file(file_name);
+	const char* text = file.data();
+	size_t chunks = std::max<size_t>(1, (file.size() + chunk_bytes - 1) / chunk_bytes);
+	std::vector<const char*> bounds = SplitAtLines(text, text + file.size(), chunks);
+	size_t capacity = chunk_bytes / MIN_RECORD_BYTES + 1;
+	for (size_t c = 0; c < chunks; c++)
+		capacity = std::max(capacity, (size_t)(bounds[c + 1] - bounds[c]) / MIN_RECORD_BYTES + 1);
+
+	std::vector<cl::Event> transfer_events, compute_events;
+	std::vector<PipelineSlot> slots(PIPELINE_DEPTH);
+	for (size_t i = 0; i < slots.size(); i++) {
+		PipelineSlot& slot = slots[i];
+		slot.staging = pool.AcquireStaging(capacity * sizeof(float));
+		slot.input = pool.Acquire(capacity * sizeof(float), CL_MEM_READ_ONLY);
+		slot.ping = pool.Acquire(MAX_REDUCE_GROUPS * sizeof(StatsPartial));
+		slot.pong = pool.Acquire(MAX_REDUCE_GROUPS * sizeof(StatsPartial));
+		slot.host = (float*)transfer_queue.enqueueMapBuffer(slot.staging, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0, capacity * sizeof(float),
+			NULL, &slot.mapped);
+		slot.count = 0;
+		slot.busy = false;
+		slot.writable = true;
+	}
+	transfer_queue.flush();
+
+	// producer -> consumer: chunks parsed so far; consumer -> producer: slots writable again
+	std::mutex mutex;
+	std::condition_variable changed;
+	size_t parsed = 0;
+	bool stop = false;
+	std::exception_ptr error;
+	double parse_ms = 0;
+
+	std::thread producer([&]() {
+		try {
+			for (size_t c = 0; c < chunks; c++) {
+				PipelineSlot& slot = slots[c % slots.size()];
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					while (!slot.writable && !stop)
+						changed.wait(lock);
+					if (stop)
+						return;
+				}
+
+				std::chrono::high_resolution_clock::time_point parse_start = std::chrono::high_resolution_clock::now();
+				Dataset chunk;
+				ParseDataset(bounds[c], bounds[c + 1], chunk);
+				slot.mapped.wait();
+				if (chunk.size())
+					memcpy(slot.host, chunk.temperature.data(), chunk.size() * sizeof(float));
+				double ms = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - parse_start).count() / 1000.0;
+
+				std::lock_guard<std::mutex> lock(mutex);
+				slot.count = chunk.size();
+				slot.writable = false;
+				parse_ms += ms;
+				parsed = c + 1;
+				changed.notify_all();
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			error = std::current_exception();
+			stop = true;
+			changed.notify_all();
+		}
+	});
+
+	size_t local_size = 0;
+	try {
+		for (size_t c = 0; c < chunks; c++) {
+			PipelineSlot& slot = slots[c % slots.size()];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (parsed <= c && !stop)
+					changed.wait(lock);
+				if (error)
+					std::rethrow_exception(error);
+			}
+
+			// the slot's previous reduction read the device input that the copy below overwrites
+			std::vector<cl::Event> input_free;
+			if (slot.busy) {
+				input_free.push_back(slot.done);
+				slot.busy = false;
+			}
+
+			if (slot.count) {
+				if (!local_size)
+					local_size = local_size_for(slot.host, slot.count);
+
+				std::vector<cl::Event> uploaded(1);
+				cl::Event unmap_event;
+				transfer_queue.enqueueUnmapMemObject(slot.staging.Buffer(), slot.host, NULL, &unmap_event);
+				slot.host = NULL;
+				input_free.push_back(unmap_event);
+				transfer_queue.enqueueCopyBuffer(slot.staging, slot.input, 0, 0, slot.count * sizeof(float), &input_free, &uploaded[0]);
+				transfer_events.push_back(unmap_event);
+				transfer_events.push_back(uploaded[0]);
+
+				// merge the previous partial of this slot before its result is overwritten
+				if (input_free.size() > 1) {
+					input_free[0].wait();
+					CombineStats(total, slot.result);
+				}
+
+				slot.done = EnqueueReduceStats(compute_queue, first_pass, merge_pass, slot.input, slot.count, slot.ping, slot.pong, local_size,
+					&slot.result, compute_events, &uploaded);
+				slot.busy = true;
+				compute_queue.flush();
+
+				// the producer can refill the staging buffer as soon as the copy has read it
+				cl::Event map_event;
+				slot.host = (float*)transfer_queue.enqueueMapBuffer(slot.staging, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0, capacity * sizeof(float),
+					&uploaded, &map_event);
+				slot.mapped = map_event;
+				transfer_queue.flush();
+			}
+			else if (input_free.size()) {
+				input_free[0].wait();
+				CombineStats(total, slot.result);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			slot.writable = true;
+			changed.notify_all();
+		}
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+			changed.notify_all();
+		}
+		producer.join();
+
+		// the reductions still in flight read back into slots[i].result and the staging buffers go back to the pool
+		// with slots, so wait for both queues and unmap before leaving; a failure here would only hide the first error
+		try {
+			compute_queue.finish();
+			for (size_t i = 0; i < slots.size(); i++)
+				if (slots[i].host)
+					transfer_queue.enqueueUnmapMemObject(slots[i].staging.Buffer(), slots[i].host);
+			transfer_queue.finish();
+		}
+		catch (const cl::Error&) {
+		}
+		throw;
+	}
+	producer.join();
+
+	// merge whatever is still in flight, then hand the staging buffers back
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].busy) {
+			slots[i].done.wait();
+			CombineStats(total, slots[i].result);
+		}
+		cl::Event unmap_event;
+		transfer_queue.enqueueUnmapMemObject(slots[i].staging.Buffer(), slots[i].host, NULL, &unmap_event);
+		transfer_events.push_back(unmap_event);
+	}
+	transfer_queue.finish();
+
+	timing.chunks = chunks;
+	timing.records = (size_t)total.count;
+	timing.parse_ms = parse_ms;
+	timing.transfer_ms = GetTotalExecutionTime(transfer_events) / 1e6;
+	timing.compute_ms = GetTotalExecutionTime(compute_events) / 1e6;
+	timing.total_ms = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0;
+	events.insert(events.end(), transfer_events.begin(), transfer_events.end());
+	events.insert(events.end(), compute_events.begin(), compute_events.end());
+	return total;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+// profiling of every enqueued command, grouped into named stages (one stage per feature or pass)
+// the events are read when they are recorded, so record them once the commands have completed
+
+// one profiled command, times in ns on the device clock
+struct ProfiledCommand {
+	std::string stage;
+	std::string command; // kernel, write, read, fill, copy, map, unmap, ...
+	size_t queue;        // index of its queue in the order queues were first seen
+	cl_ulong queued;
+	cl_ulong submitted;
+	cl_ulong started;
+	cl_ulong ended;
+};
+
+// the commands of one kind in one stage
+struct StageProfile {
+	std::string stage;
+	std::string command;
+	size_t count;
+	double execution_ns; // start to end, summed
+	double waiting_ns;   // queued to start, summed
+	double min_ns;
+	double max_ns;
+};
+
+inline const char* CommandTypeName(cl_command_type type) {
+	switch (type) {
+	case CL_COMMAND_NDRANGE_KERNEL: return "kernel";
+	case CL_COMMAND_TASK: return "task";
+	case CL_COMMAND_NATIVE_KERNEL: return "native kernel";
+	case CL_COMMAND_READ_BUFFER: return "read";
+	case CL_COMMAND_WRITE_BUFFER: return "write";
+	case CL_COMMAND_COPY_BUFFER: return "copy";
+	case CL_COMMAND_READ_BUFFER_RECT: return "read rect";
+	case CL_COMMAND_WRITE_BUFFER_RECT: return "write rect";
+	case CL_COMMAND_COPY_BUFFER_RECT: return "copy rect";
+	case CL_COMMAND_FILL_BUFFER: return "fill";
+	case CL_COMMAND_MAP_BUFFER: return "map";
+	case CL_COMMAND_UNMAP_MEM_OBJECT: return "unmap";
+	case CL_COMMAND_MARKER: return "marker";
+	case CL_COMMAND_BARRIER: return "barrier";
+	default: return "other";
+	}
+}
+
+class Profiler {
+public:
+	// add completed, profiled events under a stage name
+	void Record(const std::string& stage, const std::vector<cl::Event>& events) {
+		for (size_t i = 0; i < events.size(); i++)
+			Record(stage, events[i]);
+	}
+
+	void Record(const std::string& stage, const cl::Event& event) {
+		ProfiledCommand command;
+		command.stage = stage;
+		command.command = CommandTypeName(event.getInfo<CL_EVENT_COMMAND_TYPE>());
+		cl_command_queue queue = event.getInfo<CL_EVENT_COMMAND_QUEUE>()();
+		std::map<cl_command_queue, size_t>::const_iterator known = queues_.find(queue);
+		if (known == queues_.end())
+			known = queues_.insert(std::make_pair(queue, queues_.size())).first;
+		command.queue = known->second;
+		command.queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		command.submitted = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		command.started = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		command.ended = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		commands_.push_back(command);
+	}
+
+	const std::vector<ProfiledCommand>& Commands() const { return commands_; }
+
+	void Clear() {
+		commands_.clear();
+		queues_.clear();
+	}
+
+	// per stage and command kind, in the order they were first recorded
+	std::vector<StageProfile> Aggregate() const {
+		std::vector<StageProfile> profiles;
+		std::map<std::pair<std::string, std::string>, size_t> index;
+		for (size_t i = 0; i < commands_.size(); i++) {
+			const ProfiledCommand& command = commands_[i];
+			std::pair<std::string, std::string> key(command.stage, command.command);
+			std::map<std::pair<std::string, std::string>, size_t>::const_iterator found = index.find(key);
+			if (found == index.end()) {
+				StageProfile profile = { command.stage, command.command, 0, 0, 0, 0, 0 };
+				found = index.insert(std::make_pair(key, profiles.size())).first;
+				profiles.push_back(profile);
+			}
+
+			StageProfile& profile = profiles[found->second];
+			double execution = (double)(command.ended - command.started);
+			profile.min_ns = profile.count ? std::min(profile.min_ns, execution) : execution;
+			profile.max_ns = std::max(profile.max_ns, execution);
+			profile.execution_ns += execution;
+			profile.waiting_ns += (double)(command.started - command.queued);
+			profile.count++;
+		}
+		return profiles;
+	}
+
+	void PrintSummary(std::ostream& out) const {
+		std::vector<StageProfile> profiles = Aggregate();
+		std::ios::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision();
+		out << std::left << std::setw(24) << "Stage" << std::setw(12) << "Command" << std::right << std::setw(8) << "Count"
+			<< std::setw(14) << "Total [us]" << std::setw(12) << "Min [us]" << std::setw(12) << "Max [us]" << std::setw(14) << "Waiting [us]" << std::endl;
+		out << std::fixed << std::setprecision(1);
+		for (size_t i = 0; i < profiles.size(); i++) {
+			const StageProfile& p = profiles[i];
+			out << std::left << std::setw(24) << p.stage << std::setw(12) << p.command << std::right << std::setw(8) << p.count
+				<< std::setw(14) << p.execution_ns / 1000 << std::setw(12) << p.min_ns / 1000 << std::setw(12) << p.max_ns / 1000
+				<< std::setw(14) << p.waiting_ns / 1000 << std::endl;
+		}
+		out.flags(flags);
+		out.precision(precision);
+	}
+
+	// Chrome trace event format (chrome://tracing, Perfetto): one complete event per command, one track per queue,
+	// times in us from the first command queued
+	void WriteChromeTrace(std::ostream& out) const {
+		cl_ulong origin = Origin();
+		out << "{\"traceEvents\":[";
+		for (size_t i = 0; i < commands_.size(); i++) {
+			const ProfiledCommand& c = commands_[i];
+			out << (i ? ",\n" : "\n") << "{\"name\":\"" << JsonEscape(c.command) << "\",\"cat\":\"" << JsonEscape(c.stage)
+				<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << c.queue << std::fixed << std::setprecision(3)
+				<< ",\"ts\":" << (c.started - origin) / 1000.0 << ",\"dur\":" << (c.ended - c.started) / 1000.0
+				<< ",\"args\":{\"stage\":\"" << JsonEscape(c.stage) << "\",\"queued_us\":" << (c.queued - origin) / 1000.0
+				<< ",\"waiting_us\":" << (c.started - c.queued) / 1000.0 << "}}";
+		}
+		out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+	}
+
+	// one row per command, times in ns from the first command queued
+	void WriteCsv(std::ostream& out) const {
+		cl_ulong origin = Origin();
+		out << "stage,command,queue,queued_ns,submitted_ns,started_ns,ended_ns,execution_ns" << std::endl;
+		for (size_t i = 0; i < commands_.size(); i++) {
+			const ProfiledCommand& c = commands_[i];
+			out << CsvField(c.stage) << "," << c.command << "," << c.queue << "," << c.queued - origin << "," << c.submitted - origin << ","
+				<< c.started - origin << "," << c.ended - origin << "," << c.ended - c.started << std::endl;
+		}
+	}
+
+	// <prefix>.json and <prefix>.csv
+	void Export(const std::string& prefix) const {
+		std::ofstream trace(prefix + ".json", std::ios::trunc);
+		WriteChromeTrace(trace);
+		std::ofstream csv(prefix + ".csv", std::ios::trunc);
+		WriteCsv(csv);
+		if (!trace || !csv)
+			throw std::runtime_error("Could not write the profile " + prefix);
+	}
+
+private:
+	cl_ulong Origin() const {
+		cl_ulong origin = 0;
+		for (size_t i = 0; i < commands_.size(); i++)
+			if (!i || commands_[i].queued < origin)
+				origin = commands_[i].queued;
+		return origin;
+	}
+
+	static std::string JsonEscape(const std::string& text) {
+		std::string escaped;
+		for (size_t i = 0; i < text.size(); i++) {
+			if (text[i] == '"' || text[i] == '\\')
+				escaped += '\\';
+			escaped += text[i];
+		}
+		return escaped;
+	}
+
+	static std::string CsvField(const std::string& text) {
+		if (text.find_first_of(",\"\n") == std::string::npos)
+			return text;
+		std::string quoted = "\"";
+		for (size_t i = 0; i < text.size(); i++) {
+			if (text[i] == '"')
+				quoted += '"';
+			quoted += text[i];
+		}
+		return quoted + "\"";
+	}
+
+	std::vector<ProfiledCommand> commands_;
+	std::map<cl_command_queue, size_t> queues_;
+};
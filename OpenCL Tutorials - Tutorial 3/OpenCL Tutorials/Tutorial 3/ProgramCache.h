@@ -0,0 +1,156 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Hash.h"
+
+// compiled programs cached on disk, one file per device/driver/build options/source
+//
+// layout: PROGRAM_CACHE_MAGIC, uint32 key length, the key, uint64 binary size, the binary
+// the key is kept in the file (not just hashed into its name) and compared on load, so a hash collision
+// can only cost a rebuild
+
+const char PROGRAM_CACHE_MAGIC[8] = { 'C', 'L', 'P', 'R', 'O', 'G', 'B', 0 };
+
+// prefix of the cache files, which are named <prefix>.<hash of the key>.bin
+const char DEFAULT_PROGRAM_CACHE[] = "my_kernels3";
+
+// everything the binary depends on
+inline std::string ProgramCacheKey(const cl::Device& device, const cl::Program::Sources& sources, const std::string& options) {
+	uint64_t source_hash = Fnv1a("", 0);
+	for (size_t i = 0; i < sources.size(); i++)
+		source_hash = Fnv1a(sources[i].first, sources[i].second, source_hash);
+
+	std::stringstream key;
+	key << device.getInfo<CL_DEVICE_NAME>() << "\n" << device.getInfo<CL_DEVICE_VERSION>() << "\n" << device.getInfo<CL_DRIVER_VERSION>() << "\n"
+		<< options << "\n" << std::hex << source_hash;
+	return key.str();
+}
+
+inline std::string ProgramCacheName(const std::string& prefix, const std::string& key) {
+	std::stringstream name;
+	name << prefix << "." << std::hex << std::setw(16) << std::setfill('0') << Fnv1a(key.data(), key.size()) << ".bin";
+	return name.str();
+}
+
+// the binary stored under key, empty if there is none or the file is truncated or corrupt
+inline std::vector<unsigned char> ReadProgramCache(const std::string& cache_name, const std::string& key) {
+	std::vector<unsigned char> binary;
+	std::ifstream file(cache_name, std::ios::binary | std::ios::ate);
+	std::streamoff file_size = file.tellg();
+	if (!file || file_size < 0 || !file.seekg(0))
+		return binary;
+	char magic[sizeof(PROGRAM_CACHE_MAGIC)];
+	uint32_t key_size = 0;
+	if (!file.read(magic, sizeof(magic)) || memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) ||
+		!file.read((char*)&key_size, sizeof(key_size)) || key_size != key.size())
+		return binary;
+
+	std::string stored_key(key_size, 0);
+	uint64_t binary_size = 0;
+	if (!file.read(&stored_key[0], key_size) || stored_key != key || !file.read((char*)&binary_size, sizeof(binary_size)) || !binary_size)
+		return binary;
+
+	// the stored size is only trusted up to the bytes the file has left
+	std::streamoff offset = file.tellg();
+	if (offset < 0 || binary_size > (uint64_t)(file_size - offset))
+		return binary;
+
+	binary.resize((size_t)binary_size);
+	if (!file.read((char*)&binary[0], binary.size()))
+		binary.clear();
+	return binary;
+}
+
+// store the binary of a built single-device program under key, through a temporary file
+inline bool WriteProgramCache(const std::string& cache_name, const std::string& key, const cl::Program& program) {
+	std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.size() != 1 || !sizes[0])
+		return false;
+
+	// the C++ wrapper doesn't allocate the binaries for CL_PROGRAM_BINARIES, so this goes through the C API
+	std::vector<unsigned char> binary(sizes[0]);
+	unsigned char* binaries[1] = { &binary[0] };
+	if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+		return false;
+
+	std::string temp_name = cache_name + ".tmp";
+	{
+		std::ofstream file(temp_name, std::ios::binary | std::ios::trunc);
+		uint32_t key_size = (uint32_t)key.size();
+		uint64_t binary_size = binary.size();
+		file.write(PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+		file.write((const char*)&key_size, sizeof(key_size));
+		file.write(key.data(), key.size());
+		file.write((const char*)&binary_size, sizeof(binary_size));
+		file.write((const char*)&binary[0], binary.size());
+		if (!file)
+			return false;
+	}
+
+	remove(cache_name.c_str());
+	if (rename(temp_name.c_str(), cache_name.c_str())) {
+		remove(temp_name.c_str());
+		return false;
+	}
+	return true;
+}
+
+// build sources for the context's first device, going through the on-disk binary cache
+// a cached binary is loaded with clCreateProgramWithBinary; a missing, stale or rejected one falls back to compiling
+// the source, and the new binary is cached for the next run
+// a failed source build prints the build log and rethrows; *from_cache (if given) tells which way the program was made
+inline cl::Program BuildProgramCached(const cl::Context& context, const cl::Program::Sources& sources, const std::string& options = "",
+	const std::string& cache_prefix = DEFAULT_PROGRAM_CACHE, bool* from_cache = NULL) {
+
+	std::vector<cl::Device> devices(1, context.getInfo<CL_CONTEXT_DEVICES>()[0]);
+	std::string key = ProgramCacheKey(devices[0], sources, options);
+	std::string cache_name = ProgramCacheName(cache_prefix, key);
+
+	if (from_cache)
+		*from_cache = false;
+
+	std::vector<unsigned char> binary = ReadProgramCache(cache_name, key);
+	if (!binary.empty()) {
+		try {
+			cl::Program::Binaries binaries(1, std::make_pair((const void*)&binary[0], binary.size()));
+			cl::Program program(context, devices, binaries);
+			program.build(devices, options.c_str());
+			if (from_cache)
+				*from_cache = true;
+			return program;
+		}
+		catch (const cl::Error&) {
+			// e.g. CL_INVALID_BINARY after a driver update that kept its version string
+		}
+	}
+
+	cl::Program program(context, sources);
+	try {
+		program.build(devices, options.c_str());
+	}
+	catch (const cl::Error&) {
+		std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(devices[0]) << std::endl;
+		std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(devices[0]) << std::endl;
+		std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+		throw;
+	}
+
+	if (!WriteProgramCache(cache_name, key, program))
+		std::cerr << "Could not write the program cache " << cache_name << std::endl;
+	return program;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+
+// number of workgroups needed to cover n elements
+inline size_t GroupCount(size_t n, size_t local_size) {
+	return (n + local_size - 1) / local_size;
+}
+
+// largest power of two no bigger than n
+inline size_t FloorPowerOfTwo(size_t n) {
+	size_t p = 1;
+	while (p * 2 <= n)
+		p *= 2;
+	return p;
+}
+
+// upper bound on the workgroups of a first reduction pass
+// the kernels stride over their input, so this is enough to fill a device, and few enough partials
+// for one workgroup to merge in a single second pass
+const size_t MAX_REDUCE_GROUPS = 256;
+
+// workgroups of the first reduction pass over n elements
+inline size_t ReduceGroupCount(size_t n, size_t local_size) {
+	return std::min(GroupCount(n, local_size), MAX_REDUCE_GROUPS);
+}
+
+// size in bytes of each of the two buffers used by ReduceStatsOnDevice
+inline size_t PartialsBufferSize(size_t elements, size_t local_size) {
+	return ReduceGroupCount(elements, local_size) * sizeof(StatsPartial);
+}
+
+// device-resident two-pass reduction
+// first_pass (fused_stats) folds the input into at most MAX_REDUCE_GROUPS partials in ping, then a single workgroup
+// of merge_pass (merge_stats_partials) merges those into one partial in pong, so any input takes two launches
+// local_size must be a power of two (the kernels use sequential addressing)
+// the merge waits on the event of the first pass and only the final partial is read back, into *result
+// nothing blocks: the returned event is the read-back, wait on it before using *result
+// the events of every enqueued command are appended to events so the caller can profile them
+// input_ready optionally holds the events (e.g. the upload) that the first pass must wait for
+inline cl::Event EnqueueReduceStats(cl::CommandQueue& queue, cl::Kernel& first_pass, cl::Kernel& merge_pass,
+	const cl::Buffer& input, size_t elements, const cl::Buffer& ping, const cl::Buffer& pong, size_t local_size,
+	StatsPartial* result, std::vector<cl::Event>& events, const std::vector<cl::Event>* input_ready = NULL) {
+
+	size_t nr_groups = ReduceGroupCount(elements, local_size);
+
+	first_pass.setArg(0, input);
+	first_pass.setArg(1, ping);
+	first_pass.setArg(2, (cl_uint)elements);
+	first_pass.setArg(3, cl::Local(local_size * sizeof(StatsPartial)));
+
+	std::vector<cl::Event> wait(1);
+	queue.enqueueNDRangeKernel(first_pass, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), input_ready, &wait[0]);
+	events.push_back(wait[0]);
+
+	const cl::Buffer* final_partial = &ping;
+	if (nr_groups > 1) {
+		merge_pass.setArg(0, ping);
+		merge_pass.setArg(1, pong);
+		merge_pass.setArg(2, (cl_uint)nr_groups);
+		merge_pass.setArg(3, cl::Local(local_size * sizeof(StatsPartial)));
+
+		cl::Event pass_event;
+		queue.enqueueNDRangeKernel(merge_pass, cl::NullRange, cl::NDRange(local_size), cl::NDRange(local_size), &wait, &pass_event);
+		events.push_back(pass_event);
+		wait[0] = pass_event;
+		final_partial = &pong;
+	}
+
+	cl::Event read_event;
+	queue.enqueueReadBuffer(*final_partial, CL_FALSE, 0, sizeof(StatsPartial), result, &wait, &read_event);
+	events.push_back(read_event);
+
+	return read_event;
+}
+
+// blocking version of EnqueueReduceStats
+inline StatsPartial ReduceStatsOnDevice(cl::CommandQueue& queue, cl::Kernel& first_pass, cl::Kernel& merge_pass,
+	const cl::Buffer& input, size_t elements, const cl::Buffer& ping, const cl::Buffer& pong, size_t local_size,
+	std::vector<cl::Event>& events, const std::vector<cl::Event>* input_ready = NULL) {
+
+	StatsPartial result = { 0, 0, 0, 0, 0 };
+	if (!elements)
+		return result;
+
+	EnqueueReduceStats(queue, first_pass, merge_pass, input, elements, ping, pong, local_size, &result, events, input_ready).wait();
+	return result;
+}
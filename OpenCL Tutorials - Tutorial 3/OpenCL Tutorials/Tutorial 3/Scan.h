@@ -0,0 +1,290 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Dataset.h"
+#include "Reduction.h"
+#include "BufferPool.h"
+
+// one element of a scan, must match scan_t in my_kernels3.cl
+// the prefix sum is the float-float pair hi + lo, count numbers the elements of the segment up to this one
+struct ScanElement {
+	cl_float hi;
+	cl_float lo;
+	cl_uint count;
+	cl_uint head;
+
+	double Value() const { return (double)hi + lo; }
+};
+
+// the records in time order, segmented by station
+struct TimeSeries {
+	std::vector<cl_uint> order;        // index of the record at every position
+	std::vector<cl_ushort> station;
+	std::vector<cl_uint> day;          // DayNumber of the record's date
+	std::vector<cl_float> temperature;
+
+	size_t size() const { return order.size(); }
+};
+
+// days since 1970-01-01 of a PackDate date (proleptic Gregorian calendar)
+inline cl_uint DayNumber(uint32_t date) {
+	int year = (int)DateYear(date);
+	unsigned month = DateMonth(date), day = date & 0xFF;
+	year -= month <= 2;
+	int era = (year >= 0 ? year : year - 399) / 400;
+	unsigned year_of_era = (unsigned)(year - era * 400);
+	unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	return (cl_uint)(era * 146097 + (int)day_of_era - 719468);
+}
+
+// the dataset is grouped by station but not ordered in time, so the records are sorted by station, date and time
+// (stable, records with equal times keep their file order) and the columns gathered in that order
+inline TimeSeries TimeOrderedSeries(const Dataset& data) {
+	TimeSeries series;
+	size_t n = data.size();
+	std::vector<std::pair<uint64_t, cl_uint> > keys(n);
+	for (size_t i = 0; i < n; i++)
+		keys[i] = std::make_pair(((uint64_t)data.station[i] << 48) | ((uint64_t)data.date[i] << 16) | data.time[i], (cl_uint)i);
+	std::sort(keys.begin(), keys.end());
+
+	series.order.resize(n);
+	series.station.resize(n);
+	series.day.resize(n);
+	series.temperature.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		cl_uint record = keys[i].second;
+		series.order[i] = record;
+		series.station[i] = data.station[record];
+		series.day[i] = DayNumber(data.date[record]);
+		series.temperature[i] = data.temperature[record];
+	}
+	return series;
+}
+
+// what every record adds to the heating degree-days below base: its shortfall under base divided by the number of
+// readings of its station that day, so a day contributes the mean shortfall of its readings (the integration method)
+inline std::vector<cl_float> HeatingDegreeValues(const TimeSeries& series, double base) {
+	std::vector<cl_float> values(series.size());
+	for (size_t first = 0, last; first < series.size(); first = last) {
+		for (last = first + 1; last < series.size() && series.station[last] == series.station[first] && series.day[last] == series.day[first]; last++);
+		for (size_t i = first; i < last; i++)
+			values[i] = (cl_float)(std::max(base - series.temperature[i], 0.0) / (last - first));
+	}
+	return values;
+}
+
+// positions of the last record of every station in a time series
+inline std::vector<size_t> SegmentEnds(const TimeSeries& series) {
+	std::vector<size_t> ends;
+	for (size_t i = 0; i < series.size(); i++)
+		if (i + 1 == series.size() || series.station[i + 1] != series.station[i])
+			ends.push_back(i);
+	return ends;
+}
+
+// workgroup size of the scan kernels: a power of two whose 2L-element tile fits in local memory
+inline size_t ScanLocalSize(const cl::Context& context, const cl::Program& program) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t limit = std::min<size_t>(256, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (2 * sizeof(ScanElement)));
+	limit = std::min(limit, cl::Kernel(program, "scan_values").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	limit = std::min(limit, cl::Kernel(program, "scan_partials").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	return FloorPowerOfTwo(limit);
+}
+
+// exclusive scan of n tile totals in place: the totals of their own tiles are scanned recursively (one level per
+// factor of 2L, so three levels cover billions of elements) and added back
+inline void ScanPartialsOnDevice(cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& partials, size_t n, size_t local_size, std::vector<cl::Event>& events) {
+
+	size_t tiles = (n + 2 * local_size - 1) / (2 * local_size);
+	PooledBuffer buffer_sums = pool.Acquire(tiles * sizeof(ScanElement));
+
+	cl::Kernel kernel(program, "scan_partials");
+	kernel.setArg(0, partials);
+	kernel.setArg(1, (cl_uint)n);
+	kernel.setArg(2, buffer_sums.Buffer());
+	kernel.setArg(3, cl::Local(2 * local_size * sizeof(ScanElement)));
+	cl::Event kernel_event;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+	events.push_back(kernel_event);
+
+	if (tiles > 1) {
+		ScanPartialsOnDevice(queue, program, pool, buffer_sums, tiles, local_size, events);
+
+		cl::Kernel add(program, "scan_add_offsets");
+		add.setArg(0, partials);
+		add.setArg(1, (cl_uint)n);
+		add.setArg(2, buffer_sums.Buffer());
+		cl::Event add_event;
+		queue.enqueueNDRangeKernel(add, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &add_event);
+		events.push_back(add_event);
+	}
+}
+
+// prefix sums of n floats from a device buffer, inclusive or exclusive, into a new buffer of ScanElement
+// with a keys buffer (cl_ushort per element, e.g. the station column) the scan restarts wherever the key changes,
+// with cl::Buffer() it runs over the whole input
+// the work is O(n): every tile is scanned once in local memory and gets the scanned total of the tiles before it
+// the result and the tile totals of every level are borrowed from pool, all of it is used on queue only
+inline PooledBuffer ScanOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& values, const cl::Buffer& keys, size_t n, bool inclusive, std::vector<cl::Event>& events) {
+
+	if (!n)
+		throw std::runtime_error("Cannot scan an empty input");
+
+	size_t local_size = ScanLocalSize(context, program);
+	size_t tiles = (n + 2 * local_size - 1) / (2 * local_size);
+	PooledBuffer buffer_B = pool.Acquire(n * sizeof(ScanElement));
+	PooledBuffer buffer_sums = pool.Acquire(tiles * sizeof(ScanElement));
+
+	cl::Kernel kernel(program, "scan_values");
+	kernel.setArg(0, values);
+	kernel.setArg(1, keys);
+	kernel.setArg(2, (cl_uint)n);
+	kernel.setArg(3, (cl_uint)(keys() != NULL));
+	kernel.setArg(4, (cl_uint)inclusive);
+	kernel.setArg(5, buffer_B.Buffer());
+	kernel.setArg(6, buffer_sums.Buffer());
+	kernel.setArg(7, cl::Local(2 * local_size * sizeof(ScanElement)));
+	cl::Event kernel_event;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+	events.push_back(kernel_event);
+
+	if (tiles > 1) {
+		ScanPartialsOnDevice(queue, program, pool, buffer_sums, tiles, local_size, events);
+
+		cl::Kernel add(program, "scan_add_offsets");
+		add.setArg(0, buffer_B.Buffer());
+		add.setArg(1, (cl_uint)n);
+		add.setArg(2, buffer_sums.Buffer());
+		cl::Event add_event;
+		queue.enqueueNDRangeKernel(add, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &add_event);
+		events.push_back(add_event);
+	}
+	return buffer_B;
+}
+
+// workgroup size of the integer scan kernels, found like ScanLocalSize
+inline size_t CountScanLocalSize(const cl::Context& context, const cl::Program& program) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t limit = std::min<size_t>(256, device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (2 * sizeof(cl_uint)));
+	limit = std::min(limit, cl::Kernel(program, "scan_counts").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	limit = std::min(limit, cl::Kernel(program, "scan_counts_add").getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	return FloorPowerOfTwo(limit);
+}
+
+// exclusive scan of n cl_uint counts in place, every count becomes the sum of the ones before it
+// the same O(n) tile scheme as ScanOnDevice in integers, for compaction and the like where the scan has to be exact
+// and the float-float pair would be four times the memory; the tile totals of every level are borrowed from pool
+inline void ScanCountsOnDevice(cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const cl::Buffer& counts, size_t n, size_t local_size, std::vector<cl::Event>& events) {
+
+	size_t tiles = (n + 2 * local_size - 1) / (2 * local_size);
+	PooledBuffer buffer_sums = pool.Acquire(tiles * sizeof(cl_uint));
+
+	cl::Kernel kernel(program, "scan_counts");
+	kernel.setArg(0, counts);
+	kernel.setArg(1, (cl_uint)n);
+	kernel.setArg(2, buffer_sums.Buffer());
+	kernel.setArg(3, cl::Local(2 * local_size * sizeof(cl_uint)));
+	cl::Event kernel_event;
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &kernel_event);
+	events.push_back(kernel_event);
+
+	if (tiles > 1) {
+		ScanCountsOnDevice(queue, program, pool, buffer_sums, tiles, local_size, events);
+
+		cl::Kernel add(program, "scan_counts_add");
+		add.setArg(0, counts);
+		add.setArg(1, (cl_uint)n);
+		add.setArg(2, buffer_sums.Buffer());
+		cl::Event add_event;
+		queue.enqueueNDRangeKernel(add, cl::NullRange, cl::NDRange(tiles * local_size), cl::NDRange(local_size), NULL, &add_event);
+		events.push_back(add_event);
+	}
+}
+
+inline std::vector<ScanElement> ReadScan(cl::CommandQueue& queue, const cl::Buffer& scan, size_t n, std::vector<cl::Event>& events) {
+	std::vector<ScanElement> elements(n);
+	cl::Event read_event;
+	queue.enqueueReadBuffer(scan, CL_TRUE, 0, n * sizeof(ScanElement), &elements[0], NULL, &read_event);
+	events.push_back(read_event);
+	return elements;
+}
+
+// a rolling mean and the number of records it covers, per record
+struct RollingMean {
+	std::vector<cl_float> mean;
+	std::vector<cl_uint> count;
+};
+
+// rolling mean over the window days up to every record of a time series, per station
+// one segmented inclusive scan, then every window sum is the difference of two prefixes: O(n) in total
+// (plus a binary search for every window start) instead of O(n * window)
+inline RollingMean RollingMeanOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const TimeSeries& series, cl_uint window, std::vector<cl::Event>& events) {
+
+	RollingMean rolling;
+	size_t n = series.size();
+	if (!n || !window)
+		throw std::runtime_error("A rolling mean needs records and a window of at least one day");
+
+	PooledBuffer buffer_A = pool.Acquire(n * sizeof(cl_float), CL_MEM_READ_ONLY);
+	PooledBuffer buffer_station = pool.Acquire(n * sizeof(cl_ushort), CL_MEM_READ_ONLY);
+	PooledBuffer buffer_day = pool.Acquire(n * sizeof(cl_uint), CL_MEM_READ_ONLY);
+	cl::Event write_events[3];
+	queue.enqueueWriteBuffer(buffer_A, CL_FALSE, 0, n * sizeof(cl_float), &series.temperature[0], NULL, &write_events[0]);
+	queue.enqueueWriteBuffer(buffer_station, CL_FALSE, 0, n * sizeof(cl_ushort), &series.station[0], NULL, &write_events[1]);
+	queue.enqueueWriteBuffer(buffer_day, CL_FALSE, 0, n * sizeof(cl_uint), &series.day[0], NULL, &write_events[2]);
+	events.insert(events.end(), write_events, write_events + 3);
+
+	PooledBuffer prefix = ScanOnDevice(context, queue, program, pool, buffer_A, buffer_station, n, true, events);
+
+	PooledBuffer buffer_mean = pool.Acquire(n * sizeof(cl_float), CL_MEM_WRITE_ONLY);
+	PooledBuffer buffer_count = pool.Acquire(n * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+	cl::Kernel kernel(program, "rolling_mean");
+	kernel.setArg(0, prefix.Buffer());
+	kernel.setArg(1, buffer_day.Buffer());
+	kernel.setArg(2, (cl_uint)n);
+	kernel.setArg(3, window);
+	kernel.setArg(4, buffer_mean.Buffer());
+	kernel.setArg(5, buffer_count.Buffer());
+
+	rolling.mean.resize(n);
+	rolling.count.resize(n);
+	cl::Event kernel_event, read_events[2];
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(n), cl::NullRange, NULL, &kernel_event);
+	queue.enqueueReadBuffer(buffer_mean, CL_FALSE, 0, n * sizeof(cl_float), &rolling.mean[0], NULL, &read_events[0]);
+	queue.enqueueReadBuffer(buffer_count, CL_TRUE, 0, n * sizeof(cl_uint), &rolling.count[0], NULL, &read_events[1]);
+	events.push_back(kernel_event);
+	events.insert(events.end(), read_events, read_events + 2);
+	return rolling;
+}
+
+// cumulative heating degree-days below base for every record of a time series, per station (see HeatingDegreeValues)
+inline std::vector<ScanElement> CumulativeDegreeDaysOnDevice(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program, BufferPool& pool,
+	const TimeSeries& series, double base, std::vector<cl::Event>& events) {
+
+	size_t n = series.size();
+	std::vector<cl_float> values = HeatingDegreeValues(series, base);
+	PooledBuffer buffer_A = pool.Acquire(n * sizeof(cl_float), CL_MEM_READ_ONLY);
+	PooledBuffer buffer_station = pool.Acquire(n * sizeof(cl_ushort), CL_MEM_READ_ONLY);
+	cl::Event write_events[2];
+	queue.enqueueWriteBuffer(buffer_A, CL_FALSE, 0, n * sizeof(cl_float), &values[0], NULL, &write_events[0]);
+	queue.enqueueWriteBuffer(buffer_station, CL_FALSE, 0, n * sizeof(cl_ushort), &series.station[0], NULL, &write_events[1]);
+	events.insert(events.end(), write_events, write_events + 2);
+
+	PooledBuffer cumulative = ScanOnDevice(context, queue, program, pool, buffer_A, buffer_station, n, true, events);
+	return ReadScan(queue, cumulative, n, events);
+}
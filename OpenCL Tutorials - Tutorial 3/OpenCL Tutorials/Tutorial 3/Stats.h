@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+// partial statistics written by the fused_stats kernel, one per work-group
+// the layout must match stats_t in my_kernels3.cl
+struct StatsPartial {
+	cl_float min;
+	cl_float max;
+	cl_uint count;
+	cl_float mean;
+	cl_float m2; // sum of squared differences from the mean
+};
+
+// combined statistics on the host
+// kept in double so merging tens of thousands of partials doesn't lose digits
+struct StatsSummary {
+	double min;
+	double max;
+	unsigned long long count;
+	double mean;
+	double m2;
+
+	StatsSummary() : min(std::numeric_limits<double>::infinity()), max(-std::numeric_limits<double>::infinity()), count(0), mean(0), m2(0) {}
+
+	// sample variance (n - 1), as the original std_dev pass computed it
+	double Variance() const { return (count > 1) ? m2 / (count - 1) : 0; }
+	double StdDev() const { return std::sqrt(Variance()); }
+};
+
+// merge one partial into the running total (Chan et al. parallel variance)
+inline void CombineStats(StatsSummary& total, double min, double max, unsigned long long count, double mean, double m2) {
+	if (!count)
+		return;
+
+	unsigned long long n = total.count + count;
+	double delta = mean - total.mean;
+
+	if (min < total.min) total.min = min;
+	if (max > total.max) total.max = max;
+	total.mean += delta * ((double)count / n);
+	total.m2 += m2 + delta * delta * ((double)total.count * (double)count / n);
+	total.count = n;
+}
+
+inline void CombineStats(StatsSummary& total, const StatsPartial& part) {
+	CombineStats(total, part.min, part.max, part.count, part.mean, part.m2);
+}
+
+inline void CombineStats(StatsSummary& total, const StatsSummary& part) {
+	CombineStats(total, part.min, part.max, part.count, part.mean, part.m2);
+}
+
+// the host-side combine step for a whole vector of work-group partials
+inline StatsSummary CombineStats(const std::vector<StatsPartial>& parts) {
+	StatsSummary total;
+	for (size_t i = 0; i < parts.size(); i++)
+		CombineStats(total, parts[i]);
+	return total;
+}
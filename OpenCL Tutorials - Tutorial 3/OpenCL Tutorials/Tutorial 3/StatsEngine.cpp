@@ -0,0 +1,254 @@
+#include "StatsEngine.h"
+
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+#include "Utils.h"
+#include "Reduction.h"
+#include "Streaming.h"
+#include "Percentiles.h"
+#include "ProgramCache.h"
+#include "Dataset.h"
+#include "Parallel.h"
+#include "NativeStats.h"
+#include "Pipeline.h"
+
+namespace {
+
+cl::Context SelectContext(int platform_id, int device_id) {
+	cl::Context context = GetContext(platform_id, device_id);
+	if (!context())
+		throw std::runtime_error("There is no such platform or device");
+	return context;
+}
+
+}
+
+BackendKind ParseBackend(const std::string& name) {
+	if (name == "auto") return BACKEND_AUTO;
+	if (name == "opencl") return BACKEND_OPENCL;
+	if (name == "native") return BACKEND_NATIVE;
+	throw std::runtime_error("Unknown backend " + name);
+}
+
+StatsEngine::StatsEngine(const StatsEngineOptions& options)
+	: options_(options),
+	context_(SelectContext(options.platform_id, options.device_id)),
+	device_(context_.getInfo<CL_CONTEXT_DEVICES>()[0]),
+	queue_(context_, CL_QUEUE_PROFILING_ENABLE),
+	transfer_queue_(context_, CL_QUEUE_PROFILING_ENABLE),
+	program_from_cache_(false),
+	build_time_(0),
+	tuner_(device_, DEFAULT_TUNING_CACHE, options.retune),
+	pool_(context_) {
+
+	std::ifstream file(options.kernel_file);
+	if (!file)
+		throw std::runtime_error("Could not open " + options.kernel_file);
+	source_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	sources_.push_back(std::make_pair(source_.c_str(), source_.length() + 1));
+
+	std::chrono::high_resolution_clock::time_point build_start = std::chrono::high_resolution_clock::now();
+	program_ = BuildProgramCached(context_, sources_, "", DEFAULT_PROGRAM_CACHE, &program_from_cache_);
+	build_time_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - build_start).count() / 1000.0;
+
+	first_pass_ = cl::Kernel(program_, options.precise ? "precise_stats" : "fused_stats");
+	merge_pass_ = cl::Kernel(program_, "merge_stats_partials");
+	batched_ = cl::Kernel(program_, "batched_stats");
+
+	// a first pass never writes more than MAX_REDUCE_GROUPS partials, so these are allocated once
+	ping_ = pool_.Acquire(MAX_REDUCE_GROUPS * sizeof(StatsPartial));
+	pong_ = pool_.Acquire(MAX_REDUCE_GROUPS * sizeof(StatsPartial));
+}
+
+std::string StatsEngine::Name() const {
+	return device_.getInfo<CL_DEVICE_NAME>();
+}
+
+size_t StatsEngine::ChunkElements(size_t n) const {
+	if (options_.stream_chunk_elements)
+		return options_.stream_chunk_elements;
+	if (n * sizeof(float) > device_.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
+		return DEFAULT_STREAM_CHUNK_BYTES / sizeof(float);
+	return 0;
+}
+
+void StatsEngine::Reserve(PooledBuffer& buffer, size_t bytes, cl_mem_flags flags) {
+	if (!buffer.Empty() && bytes <= buffer.Size())
+		return;
+	buffer = pool_.Acquire(bytes, flags);
+}
+
+cl::Buffer StatsEngine::InputBuffer(const float* data, size_t n) {
+	if (!((uintptr_t)data % HOST_PTR_ALIGNMENT))
+		return cl::Buffer(context_, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, n * sizeof(float), (void*)data);
+
+	Reserve(input_, n * sizeof(float), CL_MEM_READ_ONLY);
+	cl::Event upload;
+	queue_.enqueueWriteBuffer(input_, CL_FALSE, 0, n * sizeof(float), data, NULL, &upload);
+	events_.push_back(upload);
+	return input_.Buffer();
+}
+
+size_t StatsEngine::LocalSize(const float* data, size_t n) {
+	// timing on at most one streaming chunk is plenty to rank the candidates
+	size_t tuning_elements = std::min<size_t>(n, DEFAULT_STREAM_CHUNK_BYTES / sizeof(float));
+	return tuner_.Tune(first_pass_, tuning_elements, sizeof(StatsPartial), [&](size_t candidate) {
+		// merge_stats_partials runs with the same size, so it has to fit both kernels
+		if (candidate > merge_pass_.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device_))
+			throw cl::Error(CL_INVALID_WORK_GROUP_SIZE);
+		std::vector<cl::Event> tuning_events;
+		cl::Buffer input = InputBuffer(data, tuning_elements);
+		ReduceStatsOnDevice(queue_, first_pass_, merge_pass_, input, tuning_elements, ping_, pong_, candidate, tuning_events);
+		tuning_events.pop_back(); // the read-back is the same at every size
+		return GetTotalExecutionTime(tuning_events);
+	});
+}
+
+StatsResult StatsEngine::Compute(const float* data, size_t n, int mask) {
+	StatsResult result;
+	if (!n) {
+		events_.clear();
+		return result;
+	}
+
+	size_t local_size = LocalSize(data, n);
+	events_.clear();
+
+	size_t chunk_elements = ChunkElements(n);
+	if (chunk_elements) {
+		if (mask & STATS_MEDIAN)
+			throw std::runtime_error("The median needs the dataset to fit in one device allocation");
+		result.summary = StreamStats(pool_, transfer_queue_, queue_, first_pass_, merge_pass_, data, n, chunk_elements, local_size, events_);
+		return result;
+	}
+
+	cl::Buffer input = InputBuffer(data, n);
+	CombineStats(result.summary, ReduceStatsOnDevice(queue_, first_pass_, merge_pass_, input, n, ping_, pong_, local_size, events_));
+
+	if (mask & STATS_MEDIAN) {
+		std::vector<double> median(1, 50.0);
+		std::vector<size_t> ranks = PercentileRanks(median, n);
+		std::vector<float> values = SelectRanksOnDevice(context_, queue_, program_, pool_, input, n, ranks, events_);
+		result.median = InterpolatePercentiles(median, n, ranks, values)[0];
+	}
+	return result;
+}
+
+StatsResult StatsEngine::ComputeFile(const std::string& file_name, PipelineTiming* timing) {
+	events_.clear();
+	PipelineTiming own_timing;
+	StatsResult result;
+	result.summary = PipelineStats(pool_, transfer_queue_, queue_, first_pass_, merge_pass_, file_name, [&](const float* data, size_t n) {
+		// the values sit in a mapped staging buffer, the tuner gets an aligned copy it can use in place
+		AlignedFloatArray copy;
+		copy.Allocate(n);
+		memcpy(copy.data(), data, n * sizeof(float));
+		return LocalSize(copy.data(), n);
+	}, timing ? *timing : own_timing, events_);
+	return result;
+}
+
+void StatsEngine::EnqueueBatch(size_t datasets, size_t local_size) {
+	size_t nr_groups = std::min(datasets, MAX_BATCH_GROUPS);
+	batched_.setArg(0, batch_input_.Buffer());
+	batched_.setArg(1, batch_offsets_.Buffer());
+	batched_.setArg(2, (cl_uint)datasets);
+	batched_.setArg(3, batch_results_.Buffer());
+	batched_.setArg(4, cl::Local(local_size * sizeof(StatsPartial)));
+
+	cl::Event event;
+	queue_.enqueueNDRangeKernel(batched_, cl::NullRange, cl::NDRange(nr_groups * local_size), cl::NDRange(local_size), NULL, &event);
+	events_.push_back(event);
+}
+
+std::vector<StatsResult> StatsEngine::ComputeMany(const std::vector<FloatSpan>& spans, int mask) {
+	events_.clear();
+	std::vector<StatsResult> results(spans.size());
+	if (spans.empty())
+		return results;
+
+	// dataset d is elements offsets[d] up to offsets[d + 1] of the concatenated input
+	std::vector<cl_uint> offsets(spans.size() + 1, 0);
+	size_t total = 0;
+	for (size_t i = 0; i < spans.size(); i++) {
+		total += spans[i].size;
+		if (total > 0xFFFFFFFF)
+			throw std::runtime_error("A batch can hold at most 2^32 - 1 elements");
+		offsets[i + 1] = (cl_uint)total;
+	}
+
+	Reserve(batch_input_, std::max<size_t>(total, 1) * sizeof(float), CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR);
+	Reserve(batch_offsets_, offsets.size() * sizeof(cl_uint), CL_MEM_READ_ONLY);
+	Reserve(batch_results_, spans.size() * sizeof(StatsPartial), CL_MEM_WRITE_ONLY);
+
+	// the spans are copied straight into the mapped (host-allocated) input, one copy for the whole batch
+	if (total) {
+		cl::Event map_event, unmap_event;
+		float* mapped = (float*)queue_.enqueueMapBuffer(batch_input_, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, total * sizeof(float), NULL, &map_event);
+		for (size_t i = 0; i < spans.size(); i++)
+			if (spans[i].size)
+				memcpy(mapped + offsets[i], spans[i].data, spans[i].size * sizeof(float));
+		queue_.enqueueUnmapMemObject(batch_input_.Buffer(), mapped, NULL, &unmap_event);
+		events_.push_back(map_event);
+		events_.push_back(unmap_event);
+	}
+
+	cl::Event offsets_event;
+	queue_.enqueueWriteBuffer(batch_offsets_, CL_FALSE, 0, offsets.size() * sizeof(cl_uint), &offsets[0], NULL, &offsets_event);
+	events_.push_back(offsets_event);
+
+	// tuned on the average dataset size, which decides how many work-items have something to do
+	size_t local_size = tuner_.Tune(batched_, total / spans.size(), sizeof(StatsPartial), [&](size_t candidate) {
+		std::vector<cl::Event> kept;
+		kept.swap(events_);
+		EnqueueBatch(spans.size(), candidate);
+		queue_.finish();
+		double time = GetTotalExecutionTime(events_);
+		kept.swap(events_);
+		return time;
+	});
+	EnqueueBatch(spans.size(), local_size);
+
+	std::vector<StatsPartial> partials(spans.size());
+	cl::Event read_event;
+	queue_.enqueueReadBuffer(batch_results_, CL_TRUE, 0, partials.size() * sizeof(StatsPartial), &partials[0], NULL, &read_event);
+	events_.push_back(read_event);
+
+	for (size_t i = 0; i < spans.size(); i++)
+		CombineStats(results[i].summary, partials[i]);
+
+	if (mask & STATS_MEDIAN) {
+		std::vector<double> median(1, 50.0);
+		DefaultThreadPool().ParallelFor(spans.size(), [&](size_t i) {
+			if (!spans[i].size)
+				return;
+			std::vector<size_t> ranks = PercentileRanks(median, spans[i].size);
+			std::vector<float> values = SelectRanksOnHost(spans[i].data, spans[i].size, ranks);
+			results[i].median = InterpolatePercentiles(median, spans[i].size, ranks, values)[0];
+		});
+	}
+	return results;
+}
+
+std::unique_ptr<StatsBackend> CreateStatsBackend(const StatsEngineOptions& options, size_t expected_elements, bool needs_device) {
+	if (options.backend == BACKEND_NATIVE || (options.backend == BACKEND_AUTO && !needs_device && expected_elements < NATIVE_AUTO_ELEMENTS))
+		return std::unique_ptr<StatsBackend>(new NativeStats(options.native_threads));
+	if (options.backend == BACKEND_OPENCL)
+		return std::unique_ptr<StatsBackend>(new StatsEngine(options));
+
+	try {
+		return std::unique_ptr<StatsBackend>(new StatsEngine(options));
+	}
+	catch (const cl::Error&) {
+		// e.g. CL_PLATFORM_NOT_FOUND_KHR from the ICD loader when no platform is installed
+	}
+	catch (const std::runtime_error&) {
+		// no such platform or device
+	}
+	return std::unique_ptr<StatsBackend>(new NativeStats(options.native_threads));
+}
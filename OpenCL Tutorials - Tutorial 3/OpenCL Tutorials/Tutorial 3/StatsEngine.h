@@ -0,0 +1,182 @@
+#pragma once
+
+#ifndef CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#endif
+#ifndef __CL_ENABLE_EXCEPTIONS
+#define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Tuning.h"
+#include "BufferPool.h"
+
+// which results a StatsEngine call should produce
+// min, max, mean and standard deviation come from the same fused pass, so asking for any of them costs the same;
+// the median takes a radix selection on top
+enum StatsMask {
+	STATS_MIN = 1,
+	STATS_MAX = 2,
+	STATS_MEAN = 4,
+	STATS_STDDEV = 8,
+	STATS_MEDIAN = 16,
+	STATS_BASIC = STATS_MIN | STATS_MAX | STATS_MEAN | STATS_STDDEV,
+	STATS_ALL = STATS_BASIC | STATS_MEDIAN
+};
+
+struct StatsResult {
+	StatsSummary summary; // min, max, count, mean and variance
+	double median;        // only with STATS_MEDIAN
+
+	StatsResult() : median(0) {}
+};
+
+// a dataset in host memory, for StatsEngine::ComputeMany
+struct FloatSpan {
+	const float* data;
+	size_t size;
+};
+
+// where CreateStatsBackend runs the statistics
+enum BackendKind {
+	BACKEND_AUTO,   // native below NATIVE_AUTO_ELEMENTS (unless a device is needed) or without a usable device, OpenCL otherwise
+	BACKEND_OPENCL,
+	BACKEND_NATIVE
+};
+
+// parse "auto", "opencl" or "native"
+BackendKind ParseBackend(const std::string& name);
+
+// below this many elements the upload and launch latency of a device outweigh its faster reduction
+const size_t NATIVE_AUTO_ELEMENTS = 1 << 20;
+
+struct StatsEngineOptions {
+	int platform_id;
+	int device_id;
+	std::string kernel_file;
+	bool precise;                 // precise_stats instead of fused_stats for the first pass
+	bool retune;                  // ignore the tuning cache
+	size_t stream_chunk_elements; // stream every dataset in chunks of this size, 0 streams only what doesn't fit in one allocation
+	BackendKind backend;
+	size_t native_threads;        // threads of the native backend, 0 for one per core
+
+	StatsEngineOptions() : platform_id(0), device_id(0), kernel_file("my_kernels3.cl"), precise(false), retune(false), stream_chunk_elements(0),
+		backend(BACKEND_AUTO), native_threads(0) {}
+};
+
+// what the OpenCL engine and the native backend have in common
+class StatsBackend {
+public:
+	virtual ~StatsBackend() {}
+
+	// statistics of one dataset, mask is a combination of StatsMask flags
+	virtual StatsResult Compute(const float* data, size_t n, int mask = STATS_BASIC) = 0;
+
+	// statistics of many datasets, for thousands of small ones
+	virtual std::vector<StatsResult> ComputeMany(const std::vector<FloatSpan>& spans, int mask = STATS_BASIC) = 0;
+
+	// the device or host the backend runs on
+	virtual std::string Name() const = 0;
+};
+
+struct PipelineTiming;
+
+// upper bound on the workgroups of a batched_stats launch, each one loops over its share of the datasets
+const size_t MAX_BATCH_GROUPS = 4096;
+
+// owns everything the statistics need on one device - context, queues, built program, kernels, tuned workgroup sizes
+// and device buffers - so it is set up once and reused by every call
+// buffers only ever grow; a call's profiled commands are available from Events() until the next call
+class StatsEngine : public StatsBackend {
+public:
+	explicit StatsEngine(const StatsEngineOptions& options = StatsEngineOptions());
+
+	// statistics of one dataset, mask is a combination of StatsMask flags
+	// page-aligned data (see AlignedArray) is used in place, anything else is uploaded into an engine buffer;
+	// datasets bigger than one device allocation are streamed, which rules out STATS_MEDIAN
+	StatsResult Compute(const float* data, size_t n, int mask = STATS_BASIC);
+
+	// statistics of many datasets with one upload and one launch, for thousands of small ones
+	// the medians are selected on the host, in parallel, since each dataset is small
+	std::vector<StatsResult> ComputeMany(const std::vector<FloatSpan>& spans, int mask = STATS_BASIC);
+
+	std::string Name() const;
+
+	// statistics of a text dataset straight from the file, with parsing, upload and reduction overlapped (see
+	// PipelineStats); timing, if given, gets where the time went
+	StatsResult ComputeFile(const std::string& file_name, PipelineTiming* timing = NULL);
+
+	// elements per streamed chunk for a dataset of n elements, 0 if Compute reduces it in one go
+	size_t ChunkElements(size_t n) const;
+
+	// tuned workgroup size of the first pass, timed on data the first time a dataset of this magnitude comes along
+	size_t LocalSize(const float* data, size_t n);
+
+	// the engine's OpenCL objects, for work outside its own calls
+	const cl::Context& Context() const { return context_; }
+	const cl::Device& Device() const { return device_; }
+	cl::CommandQueue& Queue() { return queue_; }
+	cl::CommandQueue& TransferQueue() { return transfer_queue_; }
+	const cl::Program& Program() const { return program_; }
+	const cl::Program::Sources& Sources() const { return sources_; }
+	WorkGroupTuner& Tuner() { return tuner_; }
+	// every buffer the engine allocates comes from here, other work on the engine's queue can borrow from it as well
+	BufferPool& Pool() { return pool_; }
+
+	// how the program was obtained and how long it took, in ms
+	bool ProgramFromCache() const { return program_from_cache_; }
+	double BuildTime() const { return build_time_; }
+
+	const std::vector<cl::Event>& Events() const { return events_; }
+
+private:
+	StatsEngine(const StatsEngine&);
+	StatsEngine& operator=(const StatsEngine&);
+
+	// n floats on the device: a zero-copy buffer over aligned data, otherwise input_ after an upload
+	cl::Buffer InputBuffer(const float* data, size_t n);
+	// make sure buffer holds at least bytes, swapping it for a bigger one from the pool (without its contents) if not
+	void Reserve(PooledBuffer& buffer, size_t bytes, cl_mem_flags flags);
+	void EnqueueBatch(size_t datasets, size_t local_size);
+
+	StatsEngineOptions options_;
+	cl::Context context_;
+	cl::Device device_;
+	cl::CommandQueue queue_;
+	cl::CommandQueue transfer_queue_;
+	std::string source_;
+	cl::Program::Sources sources_;
+	cl::Program program_;
+	bool program_from_cache_;
+	double build_time_;
+	WorkGroupTuner tuner_;
+	BufferPool pool_;
+
+	cl::Kernel first_pass_;
+	cl::Kernel merge_pass_;
+	cl::Kernel batched_;
+
+	PooledBuffer ping_;
+	PooledBuffer pong_;
+	PooledBuffer input_;
+	PooledBuffer batch_input_;
+	PooledBuffer batch_offsets_;
+	PooledBuffer batch_results_;
+
+	std::vector<cl::Event> events_;
+};
+
+// the backend options ask for, for a workload of about expected_elements per call
+// BACKEND_AUTO takes the native backend for small workloads unless needs_device (the caller also wants work only a device
+// does), and falls back to it when no OpenCL device can be set up; BACKEND_OPENCL throws in that case
+std::unique_ptr<StatsBackend> CreateStatsBackend(const StatsEngineOptions& options, size_t expected_elements, bool needs_device = false);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Reduction.h"
+#include "BufferPool.h"
+
+// chunk size used when a dataset has to be streamed and no size was asked for
+const size_t DEFAULT_STREAM_CHUNK_BYTES = 64 << 20;
+
+// number of chunks in flight: one uploading, one reducing, one being read back
+const size_t STREAM_DEPTH = 3;
+
+// device memory of one in-flight chunk
+struct StreamSlot {
+	PooledBuffer input;
+	PooledBuffer ping;
+	PooledBuffer pong;
+	StatsPartial result;
+	cl::Event done; // read-back of result, the slot can be reused once it completes
+	bool busy;
+};
+
+// device memory the streaming mode needs for a given chunk size, independent of the dataset size
+inline size_t StreamDeviceMemory(size_t chunk_elements, size_t local_size) {
+	return STREAM_DEPTH * (chunk_elements * sizeof(float) + 2 * PartialsBufferSize(chunk_elements, local_size));
+}
+
+// out-of-core statistics: the input is processed in fixed-size chunks that cycle through STREAM_DEPTH device slots
+// uploads go on transfer_queue and reductions on compute_queue, linked by events, so chunk k + 1 uploads while
+// chunk k is reduced; each chunk's single partial is merged on the host as soon as its slot is needed again
+// device memory is bounded by StreamDeviceMemory(chunk_elements), not by the dataset; the slots are borrowed from pool
+// and go back to it once everything has been read back, so the next streamed dataset allocates nothing
+inline StatsSummary StreamStats(BufferPool& pool, cl::CommandQueue& transfer_queue, cl::CommandQueue& compute_queue,
+	cl::Kernel& first_pass, cl::Kernel& merge_pass, const float* data, size_t elements, size_t chunk_elements, size_t local_size,
+	std::vector<cl::Event>& events) {
+
+	StatsSummary total;
+	if (!elements)
+		return total;
+	if (chunk_elements > elements)
+		chunk_elements = elements;
+
+	size_t partials_size = PartialsBufferSize(chunk_elements, local_size);
+	std::vector<StreamSlot> slots(STREAM_DEPTH);
+	for (size_t i = 0; i < slots.size(); i++) {
+		slots[i].input = pool.Acquire(chunk_elements * sizeof(float), CL_MEM_READ_ONLY);
+		slots[i].ping = pool.Acquire(partials_size);
+		slots[i].pong = pool.Acquire(partials_size);
+		slots[i].busy = false;
+	}
+
+	size_t chunks = (elements + chunk_elements - 1) / chunk_elements;
+	for (size_t k = 0; k < chunks; k++) {
+		StreamSlot& slot = slots[k % slots.size()];
+
+		// the slot's previous chunk has to be finished before its input buffer is overwritten
+		if (slot.busy) {
+			slot.done.wait();
+			CombineStats(total, slot.result);
+		}
+
+		size_t offset = k * chunk_elements;
+		size_t count = (offset + chunk_elements <= elements) ? chunk_elements : elements - offset;
+
+		std::vector<cl::Event> uploaded(1);
+		transfer_queue.enqueueWriteBuffer(slot.input, CL_FALSE, 0, count * sizeof(float), data + offset, NULL, &uploaded[0]);
+		transfer_queue.flush();
+		events.push_back(uploaded[0]);
+
+		slot.done = EnqueueReduceStats(compute_queue, first_pass, merge_pass, slot.input, count, slot.ping, slot.pong, local_size,
+			&slot.result, events, &uploaded);
+		slot.busy = true;
+		compute_queue.flush();
+	}
+
+	// merge whatever is still in flight
+	for (size_t k = chunks; k < chunks + slots.size(); k++) {
+		StreamSlot& slot = slots[k % slots.size()];
+		if (slot.busy) {
+			slot.done.wait();
+			CombineStats(total, slot.result);
+			slot.busy = false;
+		}
+	}
+
+	return total;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Reduction.h"
+
+// where tuned work-group sizes are kept between runs
+const char DEFAULT_TUNING_CACHE[] = "work_group_tuning.txt";
+
+// timed runs of every candidate, the fastest one counts (after one untimed warm-up run)
+const int TUNING_REPETITIONS = 3;
+
+// largest work-group the tuner tries, even on devices that allow more
+const size_t MAX_TUNED_WORK_GROUP = 1024;
+
+// picks the work-group size of a kernel on one device by timing candidate sizes, and remembers the winner
+//
+// the cache is a text file with one "<key>\t<local size>" line per tuned kernel, where the key names the device,
+// its driver, the kernel and the order of magnitude of the problem, so a new driver or a much bigger dataset retunes
+class WorkGroupTuner {
+public:
+	explicit WorkGroupTuner(const cl::Device& device, const std::string& cache_file = DEFAULT_TUNING_CACHE, bool retune = false)
+		: device_(device), cache_file_(cache_file), retune_(retune) {
+		device_key_ = device.getInfo<CL_DEVICE_NAME>() + "|" + device.getInfo<CL_DRIVER_VERSION>();
+		Load();
+	}
+
+	// power-of-two work-group sizes the kernel can be launched with
+	// they start at the kernel's preferred multiple (the SIMD width on most devices) and stop at the smallest of
+	// CL_KERNEL_WORK_GROUP_SIZE and what the local memory holds, given local_bytes_per_item bytes per work-item
+	std::vector<size_t> Candidates(const cl::Kernel& kernel, size_t local_bytes_per_item) const {
+		size_t limit = std::min(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device_), MAX_TUNED_WORK_GROUP);
+		if (local_bytes_per_item) {
+			cl_ulong local_mem = device_.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+			cl_ulong used = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device_);
+			limit = std::min<size_t>(limit, (size_t)((local_mem > used ? local_mem - used : 0) / local_bytes_per_item));
+		}
+		size_t smallest = std::min(FloorPowerOfTwo(kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device_)), limit);
+
+		std::vector<size_t> candidates;
+		for (size_t size = smallest ? smallest : 1; size <= limit; size *= 2)
+			candidates.push_back(size);
+		if (candidates.empty())
+			candidates.push_back(1);
+		return candidates;
+	}
+
+	// best work-group size for kernel on a problem of n elements
+	// a cached size is returned straight away, otherwise time_run(local size) is called for every candidate and should
+	// run the kernel with that size and return its device time; candidates that fail to launch are skipped
+	size_t Tune(const cl::Kernel& kernel, size_t n, size_t local_bytes_per_item, const std::function<double(size_t)>& time_run) {
+		std::string key = Key(kernel, n);
+		std::vector<size_t> candidates = Candidates(kernel, local_bytes_per_item);
+
+		std::map<std::string, size_t>::const_iterator cached = cache_.find(key);
+		if (!retune_ && cached != cache_.end() && std::find(candidates.begin(), candidates.end(), cached->second) != candidates.end())
+			return cached->second;
+
+		size_t best = candidates.front();
+		double best_time = -1;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			try {
+				time_run(candidates[i]);
+				double time = time_run(candidates[i]);
+				for (int r = 1; r < TUNING_REPETITIONS; r++)
+					time = std::min(time, time_run(candidates[i]));
+				if (best_time < 0 || time < best_time) {
+					best = candidates[i];
+					best_time = time;
+				}
+			}
+			catch (const cl::Error&) {
+				// e.g. CL_OUT_OF_RESOURCES for too many registers at this size
+			}
+		}
+
+		cache_[key] = best;
+		Save();
+		return best;
+	}
+
+private:
+	std::string Key(const cl::Kernel& kernel, size_t n) const {
+		// problems within a factor of two of each other share a tuning
+		int magnitude = 0;
+		while (n >>= 1)
+			magnitude++;
+		std::stringstream key;
+		key << device_key_ << "|" << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << "|2^" << magnitude;
+		return key.str();
+	}
+
+	void Load() {
+		std::ifstream file(cache_file_);
+		std::string line;
+		while (getline(file, line)) {
+			size_t tab = line.rfind('\t');
+			if (tab != std::string::npos)
+				cache_[line.substr(0, tab)] = (size_t)atol(line.c_str() + tab + 1);
+		}
+	}
+
+	// rewrite the whole file, through a temporary file so a failed write keeps the old cache
+	void Save() const {
+		std::string temp_name = cache_file_ + ".tmp";
+		{
+			std::ofstream file(temp_name, std::ios::trunc);
+			for (std::map<std::string, size_t>::const_iterator it = cache_.begin(); it != cache_.end(); ++it)
+				file << it->first << "\t" << it->second << "\n";
+			if (!file) {
+				std::cerr << "Could not write the tuning cache " << cache_file_ << std::endl;
+				return;
+			}
+		}
+		remove(cache_file_.c_str());
+		rename(temp_name.c_str(), cache_file_.c_str());
+	}
+
+	cl::Device device_;
+	std::string cache_file_;
+	bool retune_;
+	std::string device_key_;
+	std::map<std::string, size_t> cache_;
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <type_traits>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "Stats.h"
+#include "Reduction.h"
+#include "ProgramCache.h"
+#include "BufferPool.h"
+
+// precision of a statistics job: half halves the bytes read per element, double keeps the variance of long
+// archives from drifting; both read the same float dataset, converted once on the host
+enum Precision {
+	PRECISION_HALF,
+	PRECISION_SINGLE,
+	PRECISION_DOUBLE
+};
+
+// parse "half", "float" or "double"
+inline Precision ParsePrecision(const std::string& name) {
+	if (name == "half") return PRECISION_HALF;
+	if (name == "double") return PRECISION_DOUBLE;
+	if (name == "float" || name == "single") return PRECISION_SINGLE;
+	throw std::runtime_error("Unknown precision " + name);
+}
+
+// float to IEEE half, rounding to nearest even (cl_half is only a storage type on the host)
+inline cl_half FloatToHalf(float value) {
+	cl_uint f;
+	memcpy(&f, &value, sizeof(f));
+	cl_uint sign = (f >> 16) & 0x8000;
+	f &= 0x7FFFFFFF;
+
+	if (f >= 0x47800000) // too big for a half, infinity or NaN
+		return (cl_half)(sign | ((f > 0x7F800000) ? 0x7E00 : 0x7C00));
+
+	if (f < 0x38800000) {
+		// subnormal half: adding 0.5 lines the half's mantissa up with the low bits of the float's,
+		// and the float addition does the rounding
+		float magnitude, half_magic;
+		cl_uint magic = 126 << 23, bits;
+		memcpy(&magnitude, &f, sizeof(f));
+		memcpy(&half_magic, &magic, sizeof(magic));
+		magnitude += half_magic;
+		memcpy(&bits, &magnitude, sizeof(bits));
+		return (cl_half)(sign | (bits - magic));
+	}
+
+	// normal half: rebias the exponent and round the 13 dropped mantissa bits, ties to even
+	cl_uint odd = (f >> 13) & 1;
+	f += ((cl_uint)(15 - 127) << 23) + 0xFFF + odd;
+	return (cl_half)(sign | (f >> 13));
+}
+
+// per element type: the accumulator, the -D options for my_kernels3.cl and the device's preferred vector width
+template<typename T> struct ElementTraits;
+
+template<> struct ElementTraits<cl_half> {
+	typedef cl_float Accumulator;
+	static const char* Options() { return "-D ELEMENT=half -D ELEMENT_HALF -D ACC=float"; }
+	static cl_uint PreferredWidth(const cl::Device& device) {
+		// devices without fp16 arithmetic report 0, the loads still convert to float vectors
+		cl_uint width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF>();
+		return width ? width : device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+	}
+	static cl_half FromFloat(float value) { return FloatToHalf(value); }
+};
+
+template<> struct ElementTraits<cl_float> {
+	typedef cl_float Accumulator;
+	static const char* Options() { return "-D ELEMENT=float -D ACC=float"; }
+	static cl_uint PreferredWidth(const cl::Device& device) { return device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>(); }
+	static cl_float FromFloat(float value) { return value; }
+};
+
+template<> struct ElementTraits<cl_double> {
+	typedef cl_double Accumulator;
+	static const char* Options() { return "-D ELEMENT=double -D ACC=double -D USE_DOUBLE"; }
+	static cl_uint PreferredWidth(const cl::Device& device) { return device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>(); }
+	static cl_double FromFloat(float value) { return value; }
+};
+
+// partials written by typed_stats, the layout must match acc_stats_t in my_kernels3.cl
+template<typename Acc> struct TypedStatsPartial {
+	Acc min;
+	Acc max;
+	cl_uint count;
+	Acc mean;
+	Acc m2;
+};
+
+template<typename Acc> inline void CombineStats(StatsSummary& total, const TypedStatsPartial<Acc>& part) {
+	CombineStats(total, part.min, part.max, part.count, part.mean, part.m2);
+}
+
+// OpenCL vector widths go 1, 2, 4, 8, 16
+inline cl_uint ValidVectorWidth(cl_uint width) {
+	cl_uint valid = 1;
+	while (valid * 2 <= width && valid < 16)
+		valid *= 2;
+	return valid;
+}
+
+// typed_stats and typed_stats_merge instantiated for element type T
+// the kernel source is built with T's -D options and a vector width (0 takes the device's preferred width)
+template<typename T> class TypedStats {
+public:
+	typedef typename ElementTraits<T>::Accumulator Accumulator;
+	typedef TypedStatsPartial<Accumulator> Partial;
+
+	TypedStats(const cl::Context& context, const cl::Program::Sources& sources, cl_uint vector_width = 0) : context_(context) {
+		cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+		if (sizeof(Accumulator) == sizeof(cl_double) && !device.getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>())
+			throw std::runtime_error("The device has no double precision support");
+
+		vector_width_ = ValidVectorWidth(vector_width ? vector_width : ElementTraits<T>::PreferredWidth(device));
+
+		std::stringstream options;
+		options << ElementTraits<T>::Options() << " -D VECTOR_WIDTH=" << vector_width_;
+		program_ = BuildProgramCached(context, sources, options.str());
+
+		first_pass_ = cl::Kernel(program_, "typed_stats");
+		merge_pass_ = cl::Kernel(program_, "typed_stats_merge");
+		local_size_ = FloorPowerOfTwo(std::min<size_t>(256, std::min(first_pass_.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+			merge_pass_.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))));
+	}
+
+	cl_uint VectorWidth() const { return vector_width_; }
+
+	// statistics of n floats, converted to T on the host first (float is used in place)
+	// the converted input and the partials are borrowed from pool, which has to belong to the job's context
+	StatsSummary Compute(cl::CommandQueue& queue, BufferPool& pool, const float* data, size_t n, std::vector<cl::Event>& events) {
+		StatsSummary total;
+		if (!n)
+			return total;
+
+		cl::Buffer input;
+		PooledBuffer converted_input;
+		std::vector<T> converted;
+		if (std::is_same<T, cl_float>::value) {
+			input = cl::Buffer(context_, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, n * sizeof(float), (void*)data);
+		}
+		else {
+			converted.resize(n);
+			for (size_t i = 0; i < n; i++)
+				converted[i] = ElementTraits<T>::FromFloat(data[i]);
+			// an explicit upload rather than CL_MEM_COPY_HOST_PTR, so it is profiled; converted outlives the blocking read below
+			cl::Event upload_event;
+			converted_input = pool.Acquire(n * sizeof(T), CL_MEM_READ_ONLY);
+			input = converted_input.Buffer();
+			queue.enqueueWriteBuffer(input, CL_FALSE, 0, n * sizeof(T), &converted[0], NULL, &upload_event);
+			events.push_back(upload_event);
+		}
+
+		// the first pass strides over vectors, so it needs fewer workgroups the wider they are
+		size_t nr_groups = ReduceGroupCount((n + vector_width_ - 1) / vector_width_, local_size_);
+		PooledBuffer partials = pool.Acquire(nr_groups * sizeof(Partial));
+		PooledBuffer result = pool.Acquire(sizeof(Partial));
+
+		first_pass_.setArg(0, input);
+		first_pass_.setArg(1, partials.Buffer());
+		first_pass_.setArg(2, (cl_uint)n);
+		first_pass_.setArg(3, cl::Local(local_size_ * sizeof(Partial)));
+
+		merge_pass_.setArg(0, partials.Buffer());
+		merge_pass_.setArg(1, result.Buffer());
+		merge_pass_.setArg(2, (cl_uint)nr_groups);
+		merge_pass_.setArg(3, cl::Local(local_size_ * sizeof(Partial)));
+
+		cl::Event first_event, merge_event, read_event;
+		Partial partial;
+		queue.enqueueNDRangeKernel(first_pass_, cl::NullRange, cl::NDRange(nr_groups * local_size_), cl::NDRange(local_size_), NULL, &first_event);
+		queue.enqueueNDRangeKernel(merge_pass_, cl::NullRange, cl::NDRange(local_size_), cl::NDRange(local_size_), NULL, &merge_event);
+		queue.enqueueReadBuffer(result, CL_TRUE, 0, sizeof(Partial), &partial, NULL, &read_event);
+		events.push_back(first_event);
+		events.push_back(merge_event);
+		events.push_back(read_event);
+
+		CombineStats(total, partial);
+		return total;
+	}
+
+private:
+	cl::Context context_;
+	cl::Program program_;
+	cl::Kernel first_pass_;
+	cl::Kernel merge_pass_;
+	cl_uint vector_width_;
+	size_t local_size_;
+};
+
+// run one statistics job at the given precision, *vector_width is set to the width that was used
+inline StatsSummary ComputeTypedStats(Precision precision, const cl::Context& context, cl::CommandQueue& queue, BufferPool& pool,
+	const cl::Program::Sources& sources, const float* data, size_t n, cl_uint* vector_width, std::vector<cl::Event>& events) {
+
+	switch (precision) {
+	case PRECISION_HALF: {
+		TypedStats<cl_half> job(context, sources, *vector_width);
+		*vector_width = job.VectorWidth();
+		return job.Compute(queue, pool, data, n, events);
+	}
+	case PRECISION_DOUBLE: {
+		TypedStats<cl_double> job(context, sources, *vector_width);
+		*vector_width = job.VectorWidth();
+		return job.Compute(queue, pool, data, n, events);
+	}
+	default: {
+		TypedStats<cl_float> job(context, sources, *vector_width);
+		*vector_width = job.VectorWidth();
+		return job.Compute(queue, pool, data, n, events);
+	}
+	}
+}
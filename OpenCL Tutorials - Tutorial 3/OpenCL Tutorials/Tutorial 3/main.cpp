@@ -6,6 +6,9 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <memory>
+#include <cmath>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.hpp>
@@ -14,6 +17,25 @@
 #endif
 
 #include "Utils.h"
+#include "StatsEngine.h"
+#include "Stats.h"
+#include "Reduction.h"
+#include "Streaming.h"
+#include "GroupedStats.h"
+#include "Percentiles.h"
+#include "Histogram.h"
+#include "Tuning.h"
+#include "TypedStats.h"
+#include "Accuracy.h"
+#include "DatasetCache.h"
+#include "MultiDevice.h"
+#include "NativeStats.h"
+#include "Profiling.h"
+#include "Incremental.h"
+#include "Scan.h"
+#include "Pipeline.h"
+#include "Sketch.h"
+#include "Outliers.h"
 
 void print_help() {
 	std::cerr << "Application usage:" << std::endl;
@@ -21,395 +43,509 @@ void print_help() {
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
+	std::cerr << "  -s : stream the dataset through the device in chunks of this many MB" << std::endl;
+	std::cerr << "  -q : also compute these percentiles (e.g. -q 25,50,75) and compare selection, sorting and the host" << std::endl;
+	std::cerr << "  -g : also break the statistics down by any of station,year,month (e.g. -g station,year)" << std::endl;
+	std::cerr << "  -b : also compute a histogram with this many bins, over [min, max) or the given range (e.g. -b 20 or -b 20,-10,30)" << std::endl;
+	std::cerr << "  -m : reduction mode, fast (float Welford, default) or precise (shifted float-float sums)" << std::endl;
+	std::cerr << "  -a : compare the fast and precise modes against a long double host reference" << std::endl;
+	std::cerr << "  -x : also compute the statistics at this precision: half, float or double" << std::endl;
+	std::cerr << "  -w : vector width of the -x kernels (1, 2, 4, 8 or 16, default: the device's preferred width)" << std::endl;
+	std::cerr << "  -r : also compute the rolling mean over this many days per station, in time order, from a segmented prefix scan" << std::endl;
+	std::cerr << "  -e : also compute the cumulative heating degree-days below this base temperature per station (e.g. -e 15.5)" << std::endl;
+	std::cerr << "  -f : also list the records more than this many standard deviations from the mean of their station and month (e.g. -f 4)" << std::endl;
+	std::cerr << "  -z : also sketch the quantiles and distinct station-days in fixed memory, to this rank error and optional distinct count error (e.g. -z 0.01,0.02)" << std::endl;
+	std::cerr << "  -k : also compute the statistics and median of every station with one batched call" << std::endl;
+	std::cerr << "  -u : also split the statistics across every device of the platform plus this many host threads" << std::endl;
+	std::cerr << "  -n : backend, auto (default: native for small datasets without device-only options, or without a device), opencl or native" << std::endl;
+	std::cerr << "  -o : write the profile of every device command to <prefix>.json (Chrome trace) and <prefix>.csv" << std::endl;
+	std::cerr << "  -i : only refresh the running per-group statistics with the lines appended since the last -i run, and print them by -g" << std::endl;
+	std::cerr << "  -c : only compute the statistics straight from the text file, overlapping parsing, uploads and reductions" << std::endl;
+	std::cerr << "  -t : time the work-group sizes again instead of using the tuning cache" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
 int main(int argc, char **argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
-	int platform_id = 0;
-	int device_id = 0;
-
-	for (int i = 1; i < argc; i++)	{
-		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
-		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
-		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
-		else if (strcmp(argv[i], "-h") == 0) { print_help(); }
-	}
-
-	//detect any potential exceptions
+	StatsEngineOptions options;
+	size_t stream_mb = 0;
+	int group_by = 0;
+	std::vector<double> percentiles;
+	size_t histogram_bins = 0;
+	std::vector<Precision> precisions;
+	cl_uint vector_width = 0;
+	bool accuracy = false;
+	bool batch = false;
+	int split_host_threads = -1;
+	std::string profile_prefix;
+	std::vector<double> histogram_range;
+	bool incremental = false;
+	bool pipelined = false;
+	cl_uint rolling_days = 0;
+	double degree_base = NAN;
+	std::vector<double> sketch_errors;
+	double outlier_threshold = 0;
+	std::string dataset_name = "../../temp_lincolnshire_datasets/temp_lincolnshire.txt";
+
+	//detect any potential exceptions, bad command line options included
 	try {
-		// host operations
-		//2.1 Select computing devices
-		cl::Context context = GetContext(platform_id, device_id);
+		for (int i = 1; i < argc; i++)	{
+			if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { options.platform_id = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { options.device_id = atoi(argv[++i]); }
+			else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
+			else if ((strcmp(argv[i], "-s") == 0) && (i < (argc - 1))) { stream_mb = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-q") == 0) && (i < (argc - 1))) { percentiles = ParsePercentiles(argv[++i]); }
+			else if ((strcmp(argv[i], "-g") == 0) && (i < (argc - 1))) { group_by = ParseGroupBy(argv[++i]); }
+			else if ((strcmp(argv[i], "-b") == 0) && (i < (argc - 1))) {
+				histogram_range = ParseNumberList(argv[++i]);
+				if ((histogram_range.size() != 1 && histogram_range.size() != 3) || !(histogram_range[0] >= 1) || histogram_range[0] != floor(histogram_range[0]))
+					throw std::runtime_error("-b takes a bin count and optionally a range, e.g. -b 20 or -b 20,-10,30");
+				histogram_bins = (size_t)histogram_range[0];
+				histogram_range.erase(histogram_range.begin());
+				if (!histogram_range.empty() && !(histogram_range[0] < histogram_range[1]))
+					throw std::runtime_error("The -b range has to be increasing");
+			}
+			else if ((strcmp(argv[i], "-x") == 0) && (i < (argc - 1))) { precisions.push_back(ParsePrecision(argv[++i])); }
+			else if ((strcmp(argv[i], "-w") == 0) && (i < (argc - 1))) { vector_width = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) { options.precise = (strcmp(argv[++i], "precise") == 0); }
+			else if (strcmp(argv[i], "-a") == 0) { accuracy = true; }
+			else if (strcmp(argv[i], "-k") == 0) { batch = true; }
+			else if ((strcmp(argv[i], "-r") == 0) && (i < (argc - 1))) { rolling_days = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-e") == 0) && (i < (argc - 1))) { degree_base = atof(argv[++i]); }
+			else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { outlier_threshold = atof(argv[++i]); }
+			else if ((strcmp(argv[i], "-z") == 0) && (i < (argc - 1))) {
+				sketch_errors = ParseNumberList(argv[++i]);
+				if (sketch_errors.empty() || sketch_errors.size() > 2)
+					throw std::runtime_error("-z takes a rank error and optionally a distinct count error");
+			}
+			else if ((strcmp(argv[i], "-u") == 0) && (i < (argc - 1))) { split_host_threads = atoi(argv[++i]); }
+			else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { profile_prefix = argv[++i]; }
+			else if ((strcmp(argv[i], "-n") == 0) && (i < (argc - 1))) { options.backend = ParseBackend(argv[++i]); }
+			else if (strcmp(argv[i], "-i") == 0) { incremental = true; }
+			else if (strcmp(argv[i], "-c") == 0) { pipelined = true; }
+			else if (strcmp(argv[i], "-t") == 0) { options.retune = true; }
+			else if (strcmp(argv[i], "-h") == 0) { print_help(); }
+		}
 
-		//display the selected device
-		std::cout << "Runinng on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
+		std::chrono::high_resolution_clock::time_point startup = std::chrono::high_resolution_clock::now();
+
+		// incremental refresh: the per-group aggregates persisted next to the dataset are brought up to date from the
+		// lines appended since the last refresh only, so its cost follows the new data rather than the whole file
+		// large appends are reduced on a device (created only then), small ones on the host
+		if (incremental) {
+			std::unique_ptr<StatsEngine> engine;
+			GroupReducer reduce = [&](Dataset& appended) -> std::vector<GroupRow> {
+				if (options.backend != BACKEND_NATIVE && appended.size() >= NATIVE_AUTO_ELEMENTS) {
+					try {
+						if (!engine)
+							engine.reset(new StatsEngine(options));
+						std::vector<cl::Event> group_events;
+						return ComputeGroupedStats(engine->Context(), engine->Queue(), engine->Program(), engine->Pool(), appended,
+							engine->LocalSize(appended.temperature.data(), appended.size()), group_events);
+					}
+					catch (const cl::Error& err) {
+						std::cerr << "Reducing the appended lines on the host: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
+					}
+				}
+				return HostGroupedStats(appended);
+			};
+
+			IncrementalState state;
+			IncrementalUpdate update = UpdateIncrementalStats(dataset_name, state, reduce);
+			std::cout << (update.restarted ? "Dataset changed, statistics rebuilt: " : "Statistics refreshed: ") << update.records << " new records ("
+				<< update.bytes << " bytes), " << state.records << " in total, in "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - startup).count() / 1000.0 << " ms\n" << std::endl;
+			PrintGroupTable(std::cout, RollUpGroups(IncrementalRows(state), group_by ? group_by : GROUP_STATION), state.stations);
+			return 0;
+		}
 
-		//create a queue to which we will push commands for the device
-		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		// pipelined run: a producer thread parses the text chunk by chunk into pinned staging buffers while earlier
+		// chunks are copied to the device and reduced, all of it linked by events, so the run takes about as long as
+		// its slowest stage rather than parse + transfer + compute
+		if (pipelined) {
+			StatsEngine engine(options);
+			std::cout << "Runinng on " << engine.Name() << std::endl;
+
+			PipelineTiming timing;
+			StatsSummary stats = engine.ComputeFile(dataset_name, &timing).summary;
+
+			std::cout << "Pipelined Statistics - " << timing.chunks << " chunks, " << timing.records << " records\n" << std::endl;
+			std::cout << "Parse [ms]: " << timing.parse_ms << ", transfer [ms]: " << timing.transfer_ms << ", compute [ms]: " << timing.compute_ms << std::endl;
+			std::cout << "End to end [ms]: " << timing.total_ms << " (stages summed: " << timing.parse_ms + timing.transfer_ms + timing.compute_ms
+				<< ", slowest stage: " << std::max(timing.parse_ms, std::max(timing.transfer_ms, timing.compute_ms)) << ")\n" << std::endl;
+			std::cout << "Min = " << stats.min << std::endl;
+			std::cout << "Max = " << stats.max << std::endl;
+			std::cout << "Avg = " << stats.mean << std::endl;
+			std::cout << "Standard Deviation = " << stats.StdDev() << std::endl;
+			PrintPoolStats(std::cout, engine.Pool().Stats());
+
+			if (!profile_prefix.empty()) {
+				Profiler profiler;
+				profiler.Record("pipeline", engine.Events());
+				profiler.Export(profile_prefix);
+				std::cout << "Profile written to " << profile_prefix << ".json and " << profile_prefix << ".csv" << std::endl;
+			}
+			return 0;
+		}
 
-		//2.2 Load & build the device code
-		cl::Program::Sources sources;
+		// reading in the values from file
+		// the first run parses the text (memory-mapped, in parallel) and writes a binary columnar cache next to it,
+		// later runs map that cache directly - the temperature column is page-aligned either way, so the device
+		// can use it in place (CL_MEM_USE_HOST_PTR) without another copy
+		Dataset data;
+		bool from_cache = LoadDatasetCached(dataset_name, data);
+		if (data.empty())
+			throw std::runtime_error("The dataset has no records");
+		AlignedFloatArray& A = data.temperature;
 
-		AddSources(sources, "my_kernels3.cl");
+		std::cout << "File read in complete" << (from_cache ? " (from cache)" : "") << "...\n" << std::endl;
 
-		cl::Program program(context, sources);
+		size_t input_elements = A.size();//number of input elements
+
+		// host operations
+		// the backend is picked from the dataset size, the options that only run on a device and the devices there are
+		// (or -n); the OpenCL engine selects the device, creates the queues, builds the program (through the binary cache,
+		// so only the first run per device, driver and source pays for the compiler) and keeps all of it for every call
+		options.stream_chunk_elements = stream_mb * (1 << 20) / sizeof(float);
+		bool device_only = split_host_threads >= 0 || accuracy || !precisions.empty() || !percentiles.empty() || histogram_bins || group_by || rolling_days ||
+			!std::isnan(degree_base) || outlier_threshold > 0;
+		std::unique_ptr<StatsBackend> backend = CreateStatsBackend(options, input_elements, device_only);
+		StatsEngine* device_engine = dynamic_cast<StatsEngine*>(backend.get());
 
-		//build and debug the kernel code
-		try {
-			program.build();
+		//display the selected device
+		if (device_engine) {
+			std::cout << "Runinng on " << GetPlatformName(options.platform_id) << ", " << GetDeviceName(options.platform_id, options.device_id) << std::endl;
+			std::cout << "Program " << (device_engine->ProgramFromCache() ? "loaded from the binary cache" : "compiled from source") << " in "
+				<< device_engine->BuildTime() << " ms, ";
 		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
+		else {
+			std::cout << "Runinng on " << backend->Name() << ", ";
+		}
+		std::cout << "startup " << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - startup).count() / 1000.0 << " ms" << std::endl;
+
+		// min, max, average and standard deviation in a single pass over the data
+		// on a device the merge is kept on the device, datasets that don't fit in one device allocation (or -s) are
+		// streamed in chunks, and the workgroup size is tuned per device the first time and read from the tuning cache after that
+		size_t chunk_elements = 0;
+		if (device_engine) {
+			size_t local_size = device_engine->LocalSize(A.data(), input_elements);
+			std::cout << "Workgroup size: " << local_size << std::endl;
+
+			chunk_elements = device_engine->ChunkElements(input_elements);
+			if (chunk_elements)
+				std::cout << "Streaming in chunks of " << chunk_elements << " elements, " << StreamDeviceMemory(chunk_elements, local_size) << " bytes of device memory" << std::endl;
 		}
 
-		typedef float mytype;
-
-		std::vector<mytype> A;
-		// reading in the values from file
-		ifstream file;
-		file.open("../../temp_lincolnshire_datasets/temp_lincolnshire.txt"); // open io stream
-		string output;
-		string sub;
-
-		if (file.is_open()) {
-			while (!file.eof()) {
-				while (getline(file, output))
-				{
-					// for each line get the value 17 characters from the first " " in the txt file. This will always be the temperature value.
-					sub = output.substr(output.find(" ") + 17);
-					// insert the value into a vector
-					std::vector<mytype> A_ext(1, std::stof(sub));
-					A.insert(A.end(), A_ext.begin(), A_ext.end());
-				}
+		std::chrono::high_resolution_clock::time_point stats_start = std::chrono::high_resolution_clock::now();
+		StatsSummary stats = backend->Compute(A.data(), input_elements, STATS_BASIC).summary;
+		double statsTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - stats_start).count();
+
+		// every device command is recorded by stage, summarised at the end and exported with -o
+		Profiler profiler;
+		if (device_engine) {
+			// the events of every pass, used for profiling
+			const std::vector<cl::Event>& events = device_engine->Events();
+			profiler.Record("fused stats", events);
+			if (!chunk_elements) {
+				for (size_t i = 0; i < events.size() - 1; i++)
+					std::cout << "Pass " << i << " - " << GetFullProfilingInfo(events[i], ProfilingResolution::PROF_US) << std::endl;
 			}
+
+			// add up the device time of every enqueued command (kernel passes, and in streaming mode the uploads too)
+			double kernalTime = GetTotalExecutionTime(events);
+			std::cout << "Fused Statistics - device time [Microseconds]: " << kernalTime / 1000 << "\n" << std::endl;
 		}
+		else {
+			std::cout << "Fused Statistics - time [Microseconds]: " << statsTime / 1000 << "\n" << std::endl;
+		}
+		std::cout << "Min = " << stats.min << std::endl;
+		std::cout << "Max = " << stats.max << std::endl;
+		std::cout << "Avg = " << stats.mean << std::endl;
+		std::cout << "Standard Deviation = " << stats.StdDev() << std::endl;
+
+		// the same statistics per station through the batch API: on a device one upload and one launch for all of them
+		if (batch) {
+			std::vector<FloatSpan> spans;
+			std::vector<uint16_t> batch_stations;
+			for (size_t first = 0; first < input_elements;) {
+				size_t last = first;
+				while (last < input_elements && data.station[last] == data.station[first])
+					last++;
+				FloatSpan span = { A.data() + first, last - first };
+				spans.push_back(span);
+				batch_stations.push_back(data.station[first]);
+				first = last;
+			}
 
-		file.close(); // close io stream
-		
-		std::cout << "File read in complete...\n" << std::endl;
-
-		//host - input
-
-		//the following part adjusts the length of the input vector so it can be run for a specific workgroup size
-		//if the total input length is divisible by the workgroup size
-		//this makes the code more efficient
-		size_t local_size = 22;
-		size_t padding_size = A.size() % local_size;
-		size_t origin_input_elements = A.size(); // need the original size before padding is added
-
-		//if the input vector is not a multiple of the local_size
-		//insert additional neutral elements (0 for addition) so that the total will not be affected
-		if (padding_size) {
-			//create an extra vector with neutral values
-			std::vector<mytype> A_ext((local_size-padding_size), 0);
-			//append that extra vector to our input
-			A.insert(A.end(), A_ext.begin(), A_ext.end());
+			std::chrono::high_resolution_clock::time_point batch_start = std::chrono::high_resolution_clock::now();
+			std::vector<StatsResult> results = backend->ComputeMany(spans, STATS_ALL);
+			double batchTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - batch_start).count();
+			if (device_engine) {
+				profiler.Record("batched stats", device_engine->Events());
+				std::cout << "\nBatched Statistics - " << spans.size() << " datasets, device time [Microseconds]: " << GetTotalExecutionTime(device_engine->Events()) / 1000 << "\n" << std::endl;
+			}
+			else
+				std::cout << "\nBatched Statistics - " << spans.size() << " datasets, time [Microseconds]: " << batchTime / 1000 << "\n" << std::endl;
+			for (size_t i = 0; i < results.size(); i++) {
+				const StatsSummary& s = results[i].summary;
+				std::cout << data.stations[batch_stations[i]] << ": count " << s.count << ", min " << s.min << ", max " << s.max
+					<< ", avg " << s.mean << ", standard deviation " << s.StdDev() << ", median " << results[i].median << std::endl;
+			}
 		}
 
-		size_t input_elements = A.size();//number of input elements
-		size_t input_size = A.size()*sizeof(mytype);//size in bytes
-		size_t nr_groups = input_elements / local_size;
-		size_t output_size = A.size() * sizeof(mytype);//size in bytes
-
-		//host - output
-		std::vector<mytype> B(nr_groups); // for min val
-		std::vector<mytype> C(nr_groups); // for max val
-		std::vector<mytype> D(nr_groups); // for avg
-		std::vector<mytype> E(nr_groups); // for std dev
-		std::vector<mytype> F(nr_groups); // for std dev
-
-		//device - buffers
-		cl::Buffer buffer_A(context, CL_MEM_READ_ONLY, input_size); // input vector
-		cl::Buffer buffer_B(context, CL_MEM_READ_WRITE, output_size); // for min val
-		cl::Buffer buffer_C(context, CL_MEM_READ_WRITE, output_size); // for max val
-		cl::Buffer buffer_D(context, CL_MEM_READ_WRITE, output_size); // for avg
-		cl::Buffer buffer_E(context, CL_MEM_READ_WRITE, output_size); // for std dev
-		cl::Buffer buffer_F(context, CL_MEM_READ_WRITE, output_size); // for std dev
-
-		// device - operations
-		// copy array A to and initialise other arrays on device memory
-		queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-		queue.enqueueFillBuffer(buffer_B, 0, 0, output_size);//zero B buffer on device memory
-		queue.enqueueFillBuffer(buffer_C, 0, 0, output_size);//zero B buffer on device memory
-		queue.enqueueFillBuffer(buffer_D, 0, 0, output_size);//zero B buffer on device memory
-		queue.enqueueFillBuffer(buffer_E, 0, 0, output_size);//zero B buffer on device memory
-		queue.enqueueFillBuffer(buffer_F, 0, 0, output_size);//zero B buffer on device memory
-
-		// initialise some variables needed for the upcoming kernals
-		size_t workGroups = nr_groups*sizeof(mytype);
-		float minElements = output_size;
-		float finalMin, finalMax, finalAvg, finalStdDev = 0;
-		float b_padding = 0;
-		std::vector<mytype> originA = A; // needed to reset A after each loop
-		
-		// Minimum
-		cl::Kernel kernel_1 = cl::Kernel(program, "min_val");		
-		kernel_1.setArg(0, buffer_A);
-		kernel_1.setArg(1, buffer_B);
-		kernel_1.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
-
-		// Maximum
-		cl::Kernel kernel_2 = cl::Kernel(program, "max_val");
-		kernel_2.setArg(0, buffer_A);
-		kernel_2.setArg(1, buffer_C);
-		kernel_2.setArg(2, cl::Local(local_size*sizeof(mytype)));//local memory size
-
-		// Average -- Need to uncomment the line below that divides answer
-		cl::Kernel kernel_3 = cl::Kernel(program, "avg");
-		kernel_3.setArg(0, buffer_A);
-		kernel_3.setArg(1, buffer_D);
-		kernel_3.setArg(2, cl::Local(local_size*sizeof(mytype)));//local memory size
-		
-		// create profiling event and some variables to hold the execution times and memory transfer times for each loop iteration
-		cl::Event prof_event;
-		double kernalTime = 0;
-		string memoryTransferTime;
-		string subs;
-
-		// Minimum
-		while (minElements > local_size) {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-			// launching kernal with profiling event
-			queue.enqueueNDRangeKernel(kernel_1, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event);
-			queue.enqueueReadBuffer(buffer_B, CL_TRUE, 0, workGroups, &B[0]); // Copy the result from device to host
-
-			// resize B to the number of workgroups
-			B.resize(nr_groups);
-			// resize nr_groups so the next iteration will keep lowering the size of B with each B.resize()
-			nr_groups = (B.size() / local_size);
-			// Update minElements with the new size so the loop won't go on indefinitely 
-			minElements = B.size();
-			// Finally copy the final vector B into A - ready to be sent to the device in the next iteration
-			A = B;
-
-			// Add the kernal execution time for the last kernal execution to the total time so far
-			kernalTime = kernalTime + (prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-				prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-			// get memory transfer time for each loop
-			memoryTransferTime = GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US);
-			std::cout << memoryTransferTime << std::endl;
+		// approximate quantiles and distinct station-days from mergeable sketches, built per chunk on the host threads
+		if (!sketch_errors.empty()) {
+			double rank_error = sketch_errors[0];
+			double distinct_error = sketch_errors.size() > 1 ? sketch_errors[1] : DEFAULT_DISTINCT_ERROR;
+			std::chrono::high_resolution_clock::time_point sketch_start = std::chrono::high_resolution_clock::now();
+			DatasetSketches sketches = BuildSketches(data, rank_error, distinct_error);
+			double sketchTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - sketch_start).count();
+
+			std::cout << "\nSketches - " << sketches.chunks << " chunks merged, time [Microseconds]: " << sketchTime / 1000 << std::endl;
+			std::cout << "KLL k = " << sketches.temperature.K() << ", " << sketches.temperature.Bytes() << " bytes, rank error " << KllSketch::RankError(sketches.temperature.K())
+				<< "; HyperLogLog p = " << sketches.station_days.Precision() << ", " << sketches.station_days.Bytes() << " bytes" << std::endl;
+			std::vector<double> quantiles = percentiles;
+			if (quantiles.empty()) {
+				const double defaults[] = { 1, 5, 25, 50, 75, 95, 99 };
+				quantiles.assign(defaults, defaults + sizeof(defaults) / sizeof(defaults[0]));
+			}
+			for (size_t i = 0; i < quantiles.size(); i++)
+				std::cout << "P" << quantiles[i] << " ~ " << sketches.temperature.Quantile(quantiles[i] / 100) << std::endl;
+			std::cout << "Distinct station-days ~ " << (uint64_t)(sketches.station_days.Estimate() + 0.5) << " (+/- "
+				<< sketches.station_days.RelativeError() * 100 << "%)" << std::endl;
 		}
-		// store the min in finalMin
-		finalMin = B[0];
-		// serially loop through the final x values for the min, where x = local_size
-		// this is needed as the above loop stops when the number of elements gets lower than local_size
-		for (int i = 1; i < B.size(); i++) {
-			if (finalMin > B[i])
-				finalMin = B[i];
+
+		// everything below needs an OpenCL device, which auto only leaves out under -n native or when there is none
+		if (!device_engine) {
+			if (device_only)
+				std::cout << "\nThe native backend only computes the fused and batched statistics, the other options need an OpenCL device" << std::endl;
+			return 0;
 		}
-		
-		std::cout << "Minimum Kernel - execution time [Microseconds]: " << kernalTime / 1000 << std::endl;
-		std::cout << "Min = " << finalMin << "\n" << std::endl;
-
-		// reset some variables needed for the next kernal
-		nr_groups = input_elements / local_size;
-		minElements = output_size;
-		A = originA;
-		kernalTime = 0;
-
-		// Maximum
-		while (minElements > local_size) {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-			queue.enqueueNDRangeKernel(kernel_2, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event);
-			queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, workGroups, &C[0]);
-			
-			// resize C to the number of workgroups
-			C.resize(nr_groups);
-			// resize nr_groups so the next iteration will keep lowering the size of C with each C.resize()
-			nr_groups = C.size() / local_size;
-			// Update minElements with the new size so the loop won't go on indefinitely 
-			minElements = C.size();
-			// Finally copy the final vector C into A - ready to be sent to the device in the next iteration
-			A = C;
-
-			// Add the kernal execution time for the last kernal execution to the total time so far
-			kernalTime = kernalTime + (prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-				prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-			// get memory transfer time for each loop
-			memoryTransferTime = GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US);
-			std::cout << memoryTransferTime << std::endl;
+		StatsEngine& engine = *device_engine;
+		const cl::Context& context = engine.Context();
+		const cl::Device& device = engine.Device();
+		cl::CommandQueue& queue = engine.Queue();
+		const cl::Program& program = engine.Program();
+
+		// the same statistics split across every device of the platform and host threads
+		// the first call splits the chunks evenly and rebalances by stealing, later calls split by measured throughput
+		if (split_host_threads >= 0) {
+			SplitStats split(PlatformDevices(options.platform_id), engine.Sources(), split_host_threads);
+			StatsSummary split_stats;
+			double split_seconds = 0;
+			for (int r = 0; r < 3; r++) {
+				std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+				split_stats = split.Compute(A.data(), input_elements);
+				profiler.Record("split stats", split.Events());
+				split_seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::high_resolution_clock::now() - start).count();
+			}
+
+			std::cout << "\nSplit Statistics - " << split.Reports().size() << " workers, chunks of " << split.ChunkElements() << " elements, "
+				<< split_seconds * 1000 << " ms, " << input_elements * sizeof(float) / split_seconds / 1e9 << " GB/s\n" << std::endl;
+			for (size_t i = 0; i < split.Reports().size(); i++) {
+				const SplitWorkerReport& report = split.Reports()[i];
+				std::cout << report.name << ": " << report.chunks << " chunks (" << report.stolen << " stolen), "
+					<< report.throughput * sizeof(float) / 1e9 << " GB/s" << std::endl;
+			}
+			std::cout << "Min = " << split_stats.min << ", Max = " << split_stats.max << ", Avg = " << split_stats.mean
+				<< ", Standard Deviation = " << split_stats.StdDev() << std::endl;
 		}
-		
-		// store the max in finalMax
-		finalMax = C[0];
-
-		// serially loop through the final x values for the max, where x = local_size
-		// this is needed as the above loop stops when the number of elements gets lower than local_size
-		for (int i = 1; i < C.size(); i++) {
-			if (finalMax < C[i])
-				finalMax = C[i];
+
+		// accuracy and throughput of both reduction modes against a long double reference on the host
+		if (accuracy) {
+			size_t n = std::min<size_t>(input_elements, device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / sizeof(float));
+			cl::Buffer buffer_R(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, n * sizeof(float), A.data());
+			cl::Kernel fast_pass(program, "fused_stats");
+			cl::Kernel merge_pass(program, "merge_stats_partials");
+			cl::Kernel precise_pass(program, "precise_stats");
+			size_t accuracy_local_size = std::min(engine.LocalSize(A.data(), input_elements), FloorPowerOfTwo(std::min(fast_pass.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+				precise_pass.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))));
+
+			std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+			ReferenceStats reference = HostReferenceStats(A.data(), n);
+			double referenceTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+			start = std::chrono::high_resolution_clock::now();
+			StatsSummary host_float = HostFloatStats(A.data(), n);
+			double hostFloatTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+
+			StatsSummary fast, precise_result;
+			std::vector<cl::Event> fast_events, precise_events;
+			double fastTime = TimeDeviceStats(engine.Pool(), queue, fast_pass, merge_pass, buffer_R, n, accuracy_local_size, fast, fast_events);
+			double preciseTime = TimeDeviceStats(engine.Pool(), queue, precise_pass, merge_pass, buffer_R, n, accuracy_local_size, precise_result, precise_events);
+			profiler.Record("accuracy fast", fast_events);
+			profiler.Record("accuracy precise", precise_events);
+
+			StatsSummary reference_row;
+			reference_row.count = n;
+			reference_row.mean = (double)reference.mean;
+			reference_row.m2 = (double)(reference.variance * (n - 1));
+
+			std::cout << "\nAccuracy over " << n << " elements, errors relative to the long double reference:" << std::endl;
+			PrintAccuracyHeader(std::cout);
+			PrintAccuracyRow(std::cout, "host long double", reference_row, reference, referenceTime, n * sizeof(float));
+			PrintAccuracyRow(std::cout, "host float loop", host_float, reference, hostFloatTime, n * sizeof(float));
+			PrintAccuracyRow(std::cout, "device fast", fast, reference, fastTime, n * sizeof(float));
+			PrintAccuracyRow(std::cout, "device precise", precise_result, reference, preciseTime, n * sizeof(float));
 		}
-		
-		std::cout << "Maximum Kernel - execution time [Microseconds]: " << kernalTime / 1000 << std::endl;
-		std::cout << "Max = " << finalMax << "\n" << std::endl;
-
-		// reset some variables needed for the next kernal
-		nr_groups = input_elements / local_size;
-		minElements = output_size;
-		A = originA;
-		kernalTime = 0;
-
-		// Average
-		while (minElements > local_size) {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-			queue.enqueueNDRangeKernel(kernel_3, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event);
-			queue.enqueueReadBuffer(buffer_D, CL_TRUE, 0, workGroups, &D[0]);
-			
-			// resize D to the number of workgroups
-			D.resize(nr_groups);
-
-			// pad the vector with 0s if the size of the array isn't a multiple of local_size
-			// these zeros won't effect the final averaging sum
-			b_padding = D.size() % local_size;
-			if (b_padding) {
-				//create an extra vector with neutral values
-				std::vector<mytype> D_ext((local_size - b_padding), 0);
-				//append that extra vector to D
-				D.insert(D.end(), D_ext.begin(), D_ext.end());
-			}
 
-			// resize nr_groups so the next iteration will keep lowering the size of C with each C.resize()
-			nr_groups = D.size() / local_size;
-			// Update minElements with the new size so the loop won't go on indefinitely 
-			minElements = D.size();
-			// Finally copy the final vector D into A - ready to be sent to the device in the next iteration
-			A = D;
-
-			// Add the kernal execution time for the last kernal execution to the total time so far
-			kernalTime = kernalTime + (prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-				prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-			// get memory transfer time for each loop
-			memoryTransferTime = GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US);
-			std::cout << memoryTransferTime << std::endl;
+		// the same statistics from typed_stats, built for each requested precision
+		for (size_t i = 0; i < precisions.size(); i++) {
+			const char* names[] = { "half", "float", "double" };
+			std::vector<cl::Event> typed_events;
+			cl_uint width = vector_width;
+			StatsSummary typed = ComputeTypedStats(precisions[i], context, queue, engine.Pool(), engine.Sources(), A.data(), input_elements, &width, typed_events);
+			profiler.Record(std::string("typed stats ") + names[precisions[i]], typed_events);
+
+			std::cout << "\nTyped Statistics (" << names[precisions[i]] << ", vector width " << width << ") - device time [Microseconds]: "
+				<< GetTotalExecutionTime(typed_events) / 1000 << std::endl;
+			std::cout << "Min = " << typed.min << ", Max = " << typed.max << ", Avg = " << typed.mean << ", Standard Deviation = " << typed.StdDev() << std::endl;
 		}
-		
-		// store the average in finalAvg
-		finalAvg = D[0];
-
-		// serially loop through the final x values for the min, where x = local_size
-		// this is needed as the above loop stops when the number of elements gets lower than local_size
-		for (int i = 1; i < D.size(); i++) {
-				finalAvg = finalAvg + D[i];
+
+		// percentiles: exact radix selection on the device (four passes, no sort), benchmarked against
+		// a full bitonic sort on the device and std::nth_element on the host
+		if (!percentiles.empty()) {
+			cl::Buffer buffer_P(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, A.ByteSize(), A.data());
+			std::vector<size_t> ranks = PercentileRanks(percentiles, input_elements);
+
+			std::vector<cl::Event> select_events;
+			std::vector<float> select_ranks = SelectRanksOnDevice(context, queue, program, engine.Pool(), buffer_P, input_elements, ranks, select_events);
+			std::vector<double> selected = InterpolatePercentiles(percentiles, input_elements, ranks, select_ranks);
+
+			std::vector<cl::Event> sort_events;
+			PooledBuffer sorted = SortOnDevice(context, queue, program, engine.Pool(), buffer_P, input_elements, sort_events);
+			std::vector<float> sort_ranks = ReadRanks(queue, sorted, ranks, sort_events);
+			std::vector<double> from_sort = InterpolatePercentiles(percentiles, input_elements, ranks, sort_ranks);
+
+			std::chrono::high_resolution_clock::time_point host_start = std::chrono::high_resolution_clock::now();
+			std::vector<float> host_ranks = SelectRanksOnHost(A.data(), input_elements, ranks);
+			double hostTime = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - host_start).count();
+			std::vector<double> from_host = InterpolatePercentiles(percentiles, input_elements, ranks, host_ranks);
+
+			profiler.Record("radix select", select_events);
+			profiler.Record("bitonic sort", sort_events);
+
+			std::cout << "\nPercentiles (radix select / bitonic sort / host nth_element):" << std::endl;
+			for (size_t i = 0; i < percentiles.size(); i++)
+				std::cout << "P" << percentiles[i] << " = " << selected[i] << " / " << from_sort[i] << " / " << from_host[i] << std::endl;
+			std::cout << "Radix select - device time [Microseconds]: " << GetTotalExecutionTime(select_events) / 1000 << std::endl;
+			std::cout << "Bitonic sort - device time [Microseconds]: " << GetTotalExecutionTime(sort_events) / 1000 << std::endl;
+			std::cout << "Host nth_element - time [Microseconds]: " << hostTime / 1000 << std::endl;
 		}
 
-		// divide the final sum by the original number of input elements to get the final average
-		// important to use origin_input_elements not input_elements so the padding won't effect the result
-		finalAvg = finalAvg / origin_input_elements;
-
-		std::cout << "Average Kernel - execution time [Microseconds]: " << kernalTime / 1000 << std::endl;
-		std::cout << "Avg = " << finalAvg << "\n" << std::endl;
-
-		// Standard deviation														 
-		cl::Kernel kernel_4 = cl::Kernel(program, "std_dev");
-		kernel_4.setArg(0, buffer_A); // input
-		kernel_4.setArg(1, buffer_E); // output
-		kernel_4.setArg(2, finalAvg); // mean
-		kernel_4.setArg(3, cl::Local(local_size * sizeof(mytype)));//local memory size
-		
-		// reset some variables needed for the next kernal
-		nr_groups = input_elements / local_size;
-		minElements = output_size;
-		A = originA;
-		kernalTime = 0;
-
-
-		// std dev
-		while (minElements > local_size) {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-
-			queue.enqueueNDRangeKernel(kernel_4, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event);
-			queue.enqueueReadBuffer(buffer_E, CL_TRUE, 0, workGroups, &E[0]);
-
-			E.resize(workGroups);
-			workGroups = E.size() / local_size;
-			//std::cout << "A = " << A << std::endl;
-			//std::cout << "E = " << E << std::endl;
-			minElements = 1;
-
-			//printf("C size = %d \n", C.size());
-			//workGroups = nr_groups * sizeof(mytype);
-			A = E;
-
-			// Add the kernal execution time for the last kernal execution to the total time so far
-			kernalTime = kernalTime + (prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-				prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-			// get memory transfer time for each - as this is retruned in a string will need to get substring to add up each seperately
-			memoryTransferTime = GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US);
-			std::cout << memoryTransferTime << std::endl;
+		// histogram: bins privatized in local memory per workgroup, edges from the min/max just computed unless given
+		if (histogram_bins) {
+			double lo = histogram_range.empty() ? stats.min : histogram_range[0];
+			double hi = histogram_range.empty() ? stats.max : histogram_range[1];
+
+			cl::Buffer buffer_H(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, A.ByteSize(), A.data());
+			std::vector<cl::Event> histogram_events;
+			Histogram histogram = ComputeHistogram(context, queue, program, engine.Pool(), buffer_H, input_elements, lo, hi, histogram_bins, histogram_events);
+			profiler.Record("histogram", histogram_events);
+
+			std::cout << "\nHistogram - device time [Microseconds]: " << GetTotalExecutionTime(histogram_events) / 1000 << "\n" << std::endl;
+			PrintHistogram(std::cout, histogram);
+			std::cout << "Median (from histogram) ~ " << histogram.Percentile(50) << std::endl;
 		}
 
-		// reset some variables needed for the next kernal
-		// but dont reset kernal time
-		nr_groups = input_elements / local_size;
-		minElements = output_size;
-		A = E;
-
-		// Average -- Need to uncomment the line below that divides answer
-		cl::Kernel kernel_5 = cl::Kernel(program, "avg");
-		kernel_5.setArg(0, buffer_A);
-		kernel_5.setArg(1, buffer_F);
-		kernel_5.setArg(2, cl::Local(local_size * sizeof(mytype)));//local memory size
-
-		// summing up
-		while (minElements > local_size) {
-			queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, input_size, &A[0]);
-			queue.enqueueNDRangeKernel(kernel_5, cl::NullRange, cl::NDRange(input_elements), cl::NDRange(local_size), NULL, &prof_event);
-			queue.enqueueReadBuffer(buffer_F, CL_TRUE, 0, workGroups, &F[0]);
-
-			// resize D to the number of workgroups
-			F.resize(nr_groups);
-
-			// pad the vector with 0s if the size of the array isn't a multiple of local_size
-			// these zeros won't effect the final averaging sum
-			b_padding = F.size() % local_size;
-			if (b_padding) {
-				//create an extra vector with neutral values
-				std::vector<mytype> F_ext((local_size - b_padding), 0);
-				//append that extra vector to D
-				F.insert(F.end(), F_ext.begin(), F_ext.end());
+		// grouped statistics: every station/year/month group in one device pass, rolled up to the requested breakdown
+		// (the outlier check needs the groups too)
+		std::vector<GroupRow> group_rows;
+		if (group_by || outlier_threshold > 0) {
+			// grouped_stats keeps keys, partials and run heads in local memory, so it is tuned separately
+			size_t group_local_size = engine.Tuner().Tune(cl::Kernel(program, "grouped_stats"), input_elements, sizeof(cl_ulong) + sizeof(cl_uint) + sizeof(StatsPartial), [&](size_t candidate) {
+				std::vector<cl::Event> tuning_events;
+				ComputeGroupedStats(context, queue, program, engine.Pool(), data, candidate, tuning_events);
+				return GetTotalExecutionTime(tuning_events);
+			});
+
+			std::vector<cl::Event> group_events;
+			group_rows = ComputeGroupedStats(context, queue, program, engine.Pool(), data, group_local_size, group_events);
+			profiler.Record("grouped stats", group_events);
+
+			if (group_by) {
+				std::cout << "\nGrouped Statistics - device time [Microseconds]: " << GetTotalExecutionTime(group_events) / 1000 << "\n" << std::endl;
+				PrintGroupTable(std::cout, RollUpGroups(group_rows, group_by), data.stations);
 			}
-
-			// resize nr_groups so the next iteration will keep lowering the size of C with each C.resize()
-			nr_groups = F.size() / local_size;
-			// Update minElements with the new size so the loop won't go on indefinitely 
-			minElements = F.size();
-			// Finally copy the final vector D into A - ready to be sent to the device in the next iteration
-			A = F;
-
-			// Add the kernal execution time for the last kernal execution to the total time so far
-			kernalTime = kernalTime + (prof_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
-				prof_event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
-			// get memory transfer time for each - as this is retruned in a string will need to get substring to add up each seperately
-			memoryTransferTime = GetFullProfilingInfo(prof_event, ProfilingResolution::PROF_US);
-			std::cout << memoryTransferTime << std::endl;
 		}
-		// store the average in finalAvg
-		finalAvg = F[0];
 
-		// serially loop through the final x values for the min, where x = local_size
-		// this is needed as the above loop stops when the number of elements gets lower than local_size
-		for (int i = 1; i < F.size(); i++) {
-			finalAvg = finalAvg + F[i];
+		// outliers: z-scores against the station/month statistics and a stream compaction on the device, so only the
+		// outliers come back; the largest deviations are listed
+		if (outlier_threshold > 0) {
+			OutlierTables tables = BuildOutlierTables(group_rows, data.stations.size());
+			std::vector<cl::Event> outlier_events;
+			OutlierReport outliers = FindOutliersOnDevice(context, queue, program, engine.Pool(), data, tables, outlier_threshold, outlier_events);
+			profiler.Record("outliers", outlier_events);
+
+			std::cout << "\nOutliers beyond " << outlier_threshold << " standard deviations of their station and month - " << outliers.records.size()
+				<< " of " << input_elements << " records, device time [Microseconds]: " << GetTotalExecutionTime(outlier_events) / 1000 << "\n" << std::endl;
+			std::vector<size_t> worst(outliers.records.size());
+			for (size_t i = 0; i < worst.size(); i++)
+				worst[i] = i;
+			size_t shown = std::min<size_t>(worst.size(), 20);
+			std::partial_sort(worst.begin(), worst.begin() + shown, worst.end(), [&](size_t a, size_t b) {
+				return std::fabs(outliers.z[a]) > std::fabs(outliers.z[b]);
+			});
+			for (size_t i = 0; i < shown; i++) {
+				cl_uint record = outliers.records[worst[i]];
+				uint32_t date = data.date[record];
+				std::cout << data.stations[data.station[record]] << " " << DateYear(date) << "-" << DateMonth(date) << "-" << (date & 0xFF)
+					<< " " << data.time[record] << ": " << data.temperature[record] << " (z = " << outliers.z[worst[i]] << ")" << std::endl;
+			}
 		}
 
-		// divide the final sum by the original number of input elements -1 to get the variance
-		// std::cout << "Sum = " << finalAvg << std::endl;				
-		finalStdDev = (finalAvg / (input_elements - 1));
-		//std::cout << "Variance = " << finalStdDev << std::endl;
+		// time series: the records in time order per station, then segmented prefix scans on the device - a rolling
+		// mean is the difference of two prefixes per record and the cumulative degree-days are the prefixes themselves
+		if (rolling_days || !std::isnan(degree_base)) {
+			TimeSeries series = TimeOrderedSeries(data);
+			std::vector<size_t> ends = SegmentEnds(series);
+
+			if (rolling_days) {
+				std::vector<cl::Event> rolling_events;
+				RollingMean rolling = RollingMeanOnDevice(context, queue, program, engine.Pool(), series, rolling_days, rolling_events);
+				profiler.Record("rolling mean", rolling_events);
+
+				std::cout << "\n" << rolling_days << "-day Rolling Mean - device time [Microseconds]: " << GetTotalExecutionTime(rolling_events) / 1000 << "\n" << std::endl;
+				for (size_t s = 0, first = 0; s < ends.size(); first = ends[s++] + 1) {
+					size_t coldest = first, warmest = first;
+					for (size_t i = first; i <= ends[s]; i++) {
+						if (rolling.mean[i] < rolling.mean[coldest]) coldest = i;
+						if (rolling.mean[i] > rolling.mean[warmest]) warmest = i;
+					}
+					uint32_t last = data.date[series.order[ends[s]]];
+					std::cout << data.stations[series.station[first]] << ": latest " << rolling.mean[ends[s]] << " (" << rolling.count[ends[s]]
+						<< " records to " << DateYear(last) << "-" << DateMonth(last) << "-" << (last & 0xFF) << "), coldest " << rolling.mean[coldest]
+						<< ", warmest " << rolling.mean[warmest] << std::endl;
+				}
+			}
 
-		finalStdDev = sqrt(finalStdDev);
+			if (!std::isnan(degree_base)) {
+				std::vector<cl::Event> degree_events;
+				std::vector<ScanElement> cumulative = CumulativeDegreeDaysOnDevice(context, queue, program, engine.Pool(), series, degree_base, degree_events);
+				profiler.Record("degree-days", degree_events);
 
-		std::cout << "Standard deviation Kernel - execution time [Microseconds]: " << kernalTime /1000 << std::endl;
-		std::cout << "Standard Deviation = " << finalStdDev << std::endl;
+				std::cout << "\nHeating Degree-Days below " << degree_base << " - device time [Microseconds]: " << GetTotalExecutionTime(degree_events) / 1000 << "\n" << std::endl;
+				for (size_t s = 0, first = 0; s < ends.size(); first = ends[s++] + 1) {
+					std::cout << data.stations[series.station[first]] << ": " << cumulative[ends[s]].Value() << " over the "
+						<< cumulative[ends[s]].count << " records" << std::endl;
+				}
+			}
+		}
 
+		std::cout << "\nProfile by stage:" << std::endl;
+		profiler.PrintSummary(std::cout);
+		PrintPoolStats(std::cout, engine.Pool().Stats());
+		if (!profile_prefix.empty()) {
+			profiler.Export(profile_prefix);
+			std::cout << "Profile written to " << profile_prefix << ".json and " << profile_prefix << ".csv" << std::endl;
+		}
 	}
 	catch (cl::Error err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
 	}
+	catch (const std::exception& err) {
+		std::cerr << "ERROR: " << err.what() << std::endl;
+	}
 
 	return 0;
 }
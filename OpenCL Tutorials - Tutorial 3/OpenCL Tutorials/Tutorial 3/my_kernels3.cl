@@ -1,116 +1,971 @@
-﻿// minimum
-__kernel void min_val(__global const float* A, __global float* B, __local float* scratch) {
-	int id = get_global_id(0);
-	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	int g = get_group_id(0);
+﻿// the reduction kernels below share one shape:
+// - each work-item first reduces many elements into private registers with a grid-stride loop, so the global size
+//   does not depend on N and one launch of a few hundred workgroups covers any input
+// - the workgroup then reduces its L partials in local memory with sequential addressing (L must be a power of two):
+//   the lower half of the work-items combines element lid with lid + stride, so the active work-items stay contiguous,
+//   whole wavefronts retire together and neighbouring work-items hit neighbouring banks
+// - once REDUCE_TAIL partials are left, work-item 0 folds them on its own, saving the barriers of the last steps
 
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+#define REDUCE_TAIL 8
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+// tree reduction of the L values in scratch into scratch[0], must be preceded by a local barrier
+#define LOCAL_REDUCE(scratch, lid, L, op) \
+	for (uint stride = (L) / 2; stride >= REDUCE_TAIL; stride >>= 1) { \
+		if ((lid) < stride) \
+			scratch[lid] = op(scratch[lid], scratch[(lid) + stride]); \
+		barrier(CLK_LOCAL_MEM_FENCE); \
+	} \
+	if (!(lid)) { \
+		for (uint t = 1; t < REDUCE_TAIL; t++) \
+			if (t < (L)) \
+				scratch[0] = op(scratch[0], scratch[t]); \
+	}
 
-	//comparing scratch elements
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-		{ 
-			if(scratch[lid] > scratch[lid + i]) 
-			{
-				scratch[lid] = scratch[lid + i]; 
-			}
+float add(float a, float b) {
+	return a + b;
+}
+
+// minimum, one value per workgroup in B
+// N is the number of input elements
+__kernel void min_val(__global const float* A, __global float* B, uint N, __local float* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	float m = INFINITY;
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		m = fmin(m, A[i]);
+	scratch[lid] = m;
+
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from private to local memory
+
+	LOCAL_REDUCE(scratch, lid, L, fmin);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+// maximum (basically a copy of minimum with the comparison reversed)
+__kernel void max_val(__global const float* A, __global float* B, uint N, __local float* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	float m = -INFINITY;
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		m = fmax(m, A[i]);
+	scratch[lid] = m;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, fmax);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+// sum, divided by the count on the host to get the average
+__kernel void avg(__global const float* A, __global float* B, uint N, __local float* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	float sum = 0.0f;
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		sum += A[i];
+	scratch[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, add);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+// sum of squared differences from the mean, for the standard deviation
+// the per-workgroup sums are added up with avg
+__kernel void std_dev(__global const float* A, __global float* B, float mean, uint N, __local float* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	float sum = 0.0f;
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+		float d = A[i] - mean;
+		sum += d * d;
+	}
+	scratch[lid] = sum;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, add);
+
+	// adding to B
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+// partial statistics for a block of values
+// the layout must match StatsPartial in Stats.h
+typedef struct {
+	float min;
+	float max;
+	uint count;
+	float mean;
+	float m2; // sum of squared differences from the mean
+} stats_t;
+
+// combine two partials (Chan et al. parallel variance)
+stats_t merge_stats(stats_t a, stats_t b) {
+	uint n = a.count + b.count;
+	if (b.count == 0)
+		return a;
+	if (a.count == 0)
+		return b;
+
+	float delta = b.mean - a.mean;
+	stats_t r;
+	r.min = fmin(a.min, b.min);
+	r.max = fmax(a.max, b.max);
+	r.count = n;
+	r.mean = a.mean + delta * ((float)b.count / n);
+	r.m2 = a.m2 + b.m2 + delta * delta * ((float)a.count * (float)b.count / n);
+	return r;
+}
+
+// partial of no values, the identity of merge_stats
+stats_t empty_stats() {
+	stats_t s;
+	s.min = INFINITY;
+	s.max = -INFINITY;
+	s.count = 0;
+	s.mean = 0.0f;
+	s.m2 = 0.0f;
+	return s;
+}
+
+// Welford's update: s with one more value
+stats_t add_value(stats_t s, float x) {
+	float delta = x - s.mean;
+	s.count++;
+	s.mean += delta / s.count;
+	s.m2 += delta * (x - s.mean);
+	s.min = fmin(s.min, x);
+	s.max = fmax(s.max, x);
+	return s;
+}
+
+// fused min/max/mean/variance - every value is read from global memory once
+// every work-item folds its grid-stride share of the N inputs into one partial (Welford's update), then the workgroup
+// merges those, so B gets one partial per workgroup whatever N is
+__kernel void fused_stats(__global const float* A, __global stats_t* B, uint N, __local stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	stats_t s = empty_stats();
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		s = add_value(s, A[i]);
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from private to local memory
+
+	LOCAL_REDUCE(scratch, lid, L, merge_stats);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+
+// merges partials written by a previous pass (fused_stats or merge_stats_partials) on the device
+// N is the number of partials in A; launched as a single workgroup it reduces any number of them to one
+__kernel void merge_stats_partials(__global const stats_t* A, __global stats_t* B, uint N, __local stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	stats_t s = empty_stats();
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		s = merge_stats(s, A[i]);
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, merge_stats);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+
+// statistics of many small datasets in one launch
+// the datasets are concatenated in A, dataset d being A[offsets[d]] up to A[offsets[d + 1]]; every workgroup reduces
+// whole datasets (its group id, then every num_groups after it) the way fused_stats reduces its share, and writes
+// one finished partial per dataset to B, so thousands of datasets cost one launch instead of two each
+__kernel void batched_stats(__global const float* A, __global const uint* offsets, uint datasets, __global stats_t* B,
+	__local stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	for (uint d = get_group_id(0); d < datasets; d += get_num_groups(0)) {
+		uint end = offsets[d + 1];
+		stats_t s = empty_stats();
+		for (uint i = offsets[d] + lid; i < end; i += L)
+			s = add_value(s, A[i]);
+		scratch[lid] = s;
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		LOCAL_REDUCE(scratch, lid, L, merge_stats);
+
+		if (!lid) {
+			B[d] = scratch[0];
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+		// scratch is reused by the next dataset
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+
+// adds x to the float-float number hi + lo (Knuth's two-sum, then renormalised so lo stays below an ulp of hi)
+// the pair carries about twice the bits of a float, and unlike a plain Kahan compensation lo does not
+// grow and lose bits itself over millions of additions
+void two_sum_add(float* hi, float* lo, float x) {
+	float s = *hi + x;
+	float bb = s - *hi;
+	float err = (*hi - (s - bb)) + (x - bb) + *lo;
+	*hi = s + err;
+	*lo = err - (*hi - s);
+}
+
+// precise version of fused_stats, writes the same partials
+// every work-item sums (x - shift) and (x - shift)^2 in float-float, shift being the first input value: the shift
+// keeps the sum of squares from cancelling against the squared sum, the float-float sums (plus the rounding error
+// of each square, recovered with fma) keep what float additions drop over long grid-stride loops
+__kernel void precise_stats(__global const float* A, __global stats_t* B, uint N, __local stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	float shift = N ? A[0] : 0.0f;
+	float sum = 0.0f, sum_lo = 0.0f, squares = 0.0f, squares_lo = 0.0f;
+	stats_t s = empty_stats();
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+		float x = A[i];
+		float d = x - shift;
+		float square = d * d;
+		two_sum_add(&sum, &sum_lo, d);
+		two_sum_add(&squares, &squares_lo, square);
+		squares_lo += fma(d, d, -square);
+		s.count++;
+		s.min = fmin(s.min, x);
+		s.max = fmax(s.max, x);
 	}
+	if (s.count) {
+		float total = sum + sum_lo;
+		float mean = total / s.count;
+		s.mean = shift + mean;
+		s.m2 = fmax((squares + squares_lo) - total * mean, 0.0f);
+	}
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, merge_stats);
 
 	if (!lid) {
-		B[g] = scratch[lid];
+		B[get_group_id(0)] = scratch[0];
 	}
 }
 
-// maximum (basically a copy of minimum with just the comparign symbol reversed)
-__kernel void max_val(__global const float* A, __global float* B, __local float* scratch) {
+
+// typed statistics
+// the program is built once per element type with -D options (see TypedStats.h):
+//   ELEMENT       storage type of the input: float, double or half (half is only loaded, with vload_half,
+//                 so it needs no cl_khr_fp16); define ELEMENT_HALF as well for half
+//   ACC           accumulator type: float or double; define USE_DOUBLE as well whenever double is used
+//   VECTOR_WIDTH  elements per load: 1, 2, 4, 8 or 16
+// without options the kernels read float, accumulate in float and load one element at a time
+
+#ifndef ELEMENT
+#define ELEMENT float
+#endif
+#ifndef ACC
+#define ACC float
+#endif
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 1
+#endif
+
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+#ifdef ELEMENT_HALF
+#define LOAD_SCALAR(i, p) ((ACC)vload_half(i, p))
+#else
+#define LOAD_SCALAR(i, p) ((ACC)(p)[i])
+#endif
+
+#if VECTOR_WIDTH == 1
+#define ACCN ACC
+#define LOAD_VECTOR(i, p) LOAD_SCALAR(i, p)
+#define STORE_VECTOR(v, p) ((p)[0] = (v))
+#else
+#define ACCN CAT(ACC, VECTOR_WIDTH)
+#ifdef ELEMENT_HALF
+#define LOAD_VECTOR(i, p) CAT(convert_, ACCN)(CAT(vload_half, VECTOR_WIDTH)(i, p))
+#else
+#define LOAD_VECTOR(i, p) CAT(convert_, ACCN)(CAT(vload, VECTOR_WIDTH)(i, p))
+#endif
+#define STORE_VECTOR(v, p) CAT(vstore, VECTOR_WIDTH)(v, 0, p)
+#endif
+
+// stats_t in the accumulator type, the layout must match TypedStatsPartial in TypedStats.h
+typedef struct {
+	ACC min;
+	ACC max;
+	uint count;
+	ACC mean;
+	ACC m2;
+} acc_stats_t;
+
+acc_stats_t empty_acc_stats() {
+	acc_stats_t s;
+	s.min = INFINITY;
+	s.max = -INFINITY;
+	s.count = 0;
+	s.mean = 0;
+	s.m2 = 0;
+	return s;
+}
+
+// merge_stats in the accumulator type
+acc_stats_t merge_acc_stats(acc_stats_t a, acc_stats_t b) {
+	uint n = a.count + b.count;
+	if (b.count == 0)
+		return a;
+	if (a.count == 0)
+		return b;
+
+	ACC delta = b.mean - a.mean;
+	acc_stats_t r;
+	r.min = fmin(a.min, b.min);
+	r.max = fmax(a.max, b.max);
+	r.count = n;
+	r.mean = a.mean + delta * ((ACC)b.count / n);
+	r.m2 = a.m2 + b.m2 + delta * delta * ((ACC)a.count * (ACC)b.count / n);
+	return r;
+}
+
+// fused_stats over ELEMENT input with ACC accumulators and VECTOR_WIDTH-wide loads
+// every lane of a work-item runs its own Welford update over whole vectors (all lanes see the same count),
+// the lanes are merged at the end and the N % VECTOR_WIDTH elements left over are added one by one
+__kernel void typed_stats(__global const ELEMENT* A, __global acc_stats_t* B, uint N, __local acc_stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	uint vectors = N / VECTOR_WIDTH;
+	uint c = 0;
+	ACCN vmin = (ACCN)(INFINITY), vmax = (ACCN)(-INFINITY), vmean = (ACCN)(0), vm2 = (ACCN)(0);
+	for (uint i = get_global_id(0); i < vectors; i += get_global_size(0)) {
+		ACCN x = LOAD_VECTOR(i, A);
+		ACCN delta = x - vmean;
+		c++;
+		vmean += delta / (ACC)c;
+		vm2 += delta * (x - vmean);
+		vmin = fmin(vmin, x);
+		vmax = fmax(vmax, x);
+	}
+
+	ACC lane_min[VECTOR_WIDTH], lane_max[VECTOR_WIDTH], lane_mean[VECTOR_WIDTH], lane_m2[VECTOR_WIDTH];
+	STORE_VECTOR(vmin, lane_min);
+	STORE_VECTOR(vmax, lane_max);
+	STORE_VECTOR(vmean, lane_mean);
+	STORE_VECTOR(vm2, lane_m2);
+
+	acc_stats_t s = empty_acc_stats();
+	for (uint l = 0; l < VECTOR_WIDTH; l++) {
+		acc_stats_t lane;
+		lane.min = lane_min[l];
+		lane.max = lane_max[l];
+		lane.count = c;
+		lane.mean = lane_mean[l];
+		lane.m2 = lane_m2[l];
+		s = merge_acc_stats(s, lane);
+	}
+
+	for (uint i = vectors * VECTOR_WIDTH + get_global_id(0); i < N; i += get_global_size(0)) {
+		acc_stats_t one;
+		one.min = one.max = one.mean = LOAD_SCALAR(i, A);
+		one.count = 1;
+		one.m2 = 0;
+		s = merge_acc_stats(s, one);
+	}
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, merge_acc_stats);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+// merge_stats_partials in the accumulator type
+__kernel void typed_stats_merge(__global const acc_stats_t* A, __global acc_stats_t* B, uint N, __local acc_stats_t* scratch) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	acc_stats_t s = empty_acc_stats();
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0))
+		s = merge_acc_stats(s, A[i]);
+	scratch[lid] = s;
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	LOCAL_REDUCE(scratch, lid, L, merge_acc_stats);
+
+	if (!lid) {
+		B[get_group_id(0)] = scratch[0];
+	}
+}
+
+
+// grouped statistics
+
+// marks work-items past the end of the input, never a real group
+// (real keys never reach bit 48, the station id being 16 bits)
+#define NO_GROUP 0xFFFFFFFFFFFFFFFFUL
+
+// station/year/month group of a record, see GroupKey in GroupedStats.h
+// date is packed as year << 16 | month << 8 | day, so dropping the day leaves the year and month fields as they are
+ulong group_key(ushort station, uint date) {
+	return ((ulong)station << 32) | (date >> 8);
+}
+
+// keyed reduction over runs of records that share a station/year/month group
+// a segmented scan in local memory leaves the partial of every run in the run's last work-item, and those
+// work-items append (key, partial) to the run output at a slot taken with one global atomic per workgroup
+// records arrive sorted by station and mostly by date, so the runs number close to the groups, not the records;
+// the host merges runs that share a key (runs split across workgroups, or unsorted input)
+__kernel void grouped_stats(__global const ushort* station, __global const uint* date, __global const float* A,
+	__global ulong* run_keys, __global stats_t* run_stats, __global uint* run_count, uint N,
+	__local ulong* keys, __local stats_t* scratch, __local uint* heads) {
 	int id = get_global_id(0);
 	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	int g = get_group_id(0);
+	int L = get_local_size(0);
+
+	__local uint runs;
+	__local uint base;
+
+	ulong key = NO_GROUP;
+	stats_t s;
+	if (id < N) {
+		key = group_key(station[id], date[id]);
+		s.min = A[id];
+		s.max = s.min;
+		s.count = 1;
+		s.mean = s.min;
+	}
+	else {
+		s.min = INFINITY;
+		s.max = -INFINITY;
+		s.count = 0;
+		s.mean = 0.0f;
+	}
+	s.m2 = 0.0f;
+
+	keys[lid] = key;
+	if (!lid)
+		runs = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// a run starts wherever the key changes
+	uint head = (lid == 0) || (keys[lid - 1] != key);
+	bool tail = (lid == L - 1) || (keys[lid + 1] != key);
+	scratch[lid] = s;
+	heads[lid] = head;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// segmented inclusive scan (Hillis-Steele), merging never crosses the head of a run
+	for (int d = 1; d < L; d *= 2) {
+		stats_t prev;
+		uint prev_head = 0;
+		if (lid >= d) {
+			prev = scratch[lid - d];
+			prev_head = heads[lid - d];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (lid >= d) {
+			if (!head)
+				s = merge_stats(prev, s);
+			head |= prev_head;
+		}
+		scratch[lid] = s;
+		heads[lid] = head;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	// the last work-item of every run holds the run's partial, count them and reserve room in the output
+	bool emit = tail && (key != NO_GROUP);
+	uint slot = 0;
+	if (emit)
+		slot = atomic_inc(&runs);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!lid)
+		base = atomic_add(run_count, runs);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (emit) {
+		run_keys[base + slot] = key;
+		run_stats[base + slot] = s;
+	}
+}
 
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+// sorting and selection
+
+// float as an unsigned key with the same ordering (negative floats have every bit flipped, positive ones the sign bit)
+uint float_key(float f) {
+	uint u = as_uint(f);
+	return u ^ ((u >> 31) ? 0xFFFFFFFF : 0x80000000);
+}
 
-	// comparing stratch elements
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-		{ 
-			if(scratch[lid] < scratch[lid + i]) 
-			{
-				scratch[lid] = scratch[lid + i]; 
+// bitonic sort, the length of A must be a power of two (the host pads it with +INFINITY)
+// each work-item compare-swaps one pair, so a workgroup of L work-items covers a tile of 2L elements
+
+// sort every 2L tile in local memory, alternating direction so neighbouring tiles form bitonic sequences
+__kernel void bitonic_sort_local(__global float* A, __local float* tile) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+
+	tile[lid] = A[base + lid];
+	tile[lid + L] = A[base + lid + L];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint k = 2; k <= 2 * L; k <<= 1) {
+		for (uint j = k >> 1; j > 0; j >>= 1) {
+			uint i = 2 * lid - (lid & (j - 1)); // lower element of this work-item's pair
+			bool ascending = ((base + i) & k) == 0;
+			float a = tile[i];
+			float b = tile[i + j];
+			if ((a > b) == ascending) {
+				tile[i] = b;
+				tile[i + j] = a;
 			}
+			barrier(CLK_LOCAL_MEM_FENCE);
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
 	}
 
+	A[base + lid] = tile[lid];
+	A[base + lid + L] = tile[lid + L];
+}
 
-	if (!lid) {
-		B[g] = scratch[lid];
+// one merge step of stage k with a pair distance j of 2L or more, the pairs span tiles so this works in global memory
+__kernel void bitonic_merge_global(__global float* A, uint j, uint k) {
+	uint t = get_global_id(0);
+	uint i = 2 * t - (t & (j - 1));
+	bool ascending = (i & k) == 0;
+	float a = A[i];
+	float b = A[i + j];
+	if ((a > b) == ascending) {
+		A[i] = b;
+		A[i + j] = a;
 	}
 }
 
-// averaging
-__kernel void avg(__global const float* A, __global float* B, __local float* scratch) {
-	int id = get_global_id(0);
-	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	int g = get_group_id(0);
+// the remaining merge steps of stage k (j = L down to 1), which all stay inside one tile
+__kernel void bitonic_merge_local(__global float* A, uint k, __local float* tile) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+
+	tile[lid] = A[base + lid];
+	tile[lid + L] = A[base + lid + L];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint j = L; j > 0; j >>= 1) {
+		uint i = 2 * lid - (lid & (j - 1));
+		bool ascending = ((base + i) & k) == 0;
+		float a = tile[i];
+		float b = tile[i + j];
+		if ((a > b) == ascending) {
+			tile[i] = b;
+			tile[i + j] = a;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	A[base + lid] = tile[lid];
+	A[base + lid + L] = tile[lid + L];
+}
+
+#define RADIX_BINS 256
+
+// one pass of a radix select: for each query, count the elements whose key matches the query's prefix
+// (the digits already fixed by earlier passes) in 256 bins of the 8-bit digit at shift
+// counts go to bins privatized in local memory first, so global memory only sees one atomic per bin per workgroup
+// the kernel strides over the input, so a few workgroups cover any N
+__kernel void radix_select_count(__global const float* A, uint N, __global const uint* prefixes, uint queries, uint shift,
+	__global uint* bins, __local uint* local_bins) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	for (uint b = lid; b < queries * RADIX_BINS; b += L)
+		local_bins[b] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the digits above this pass's one
+	uint mask = (shift >= 24) ? 0 : (0xFFFFFFFF << (shift + 8));
+
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+		uint key = float_key(A[i]);
+		for (uint q = 0; q < queries; q++) {
+			if ((key & mask) == prefixes[q])
+				atomic_inc(&local_bins[q * RADIX_BINS + ((key >> shift) & 0xFF)]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint b = lid; b < queries * RADIX_BINS; b += L) {
+		if (local_bins[b])
+			atomic_add(&bins[b], local_bins[b]);
+	}
+}
+
+
+// histogram of A over bins equal-width bins starting at lo, scale = bins / (hi - lo)
+// values below lo land in the first bin and values at or above hi in the last one
+// every workgroup counts into its own copy of the bins in local memory and merges it into H with one atomic per bin,
+// instead of every element hitting global memory; the kernel strides over the input, so a few workgroups cover any N
+__kernel void histogram(__global const float* A, uint N, float lo, float scale, uint bins,
+	__global uint* H, __local uint* local_bins) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+
+	for (uint b = lid; b < bins; b += L)
+		local_bins[b] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint i = get_global_id(0); i < N; i += get_global_size(0)) {
+		float position = (A[i] - lo) * scale;
+		uint b = (position >= 0.0f) ? (uint)min(position, (float)(bins - 1)) : 0;
+		atomic_inc(&local_bins[b]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint b = lid; b < bins; b += L) {
+		if (local_bins[b])
+			atomic_add(&H[b], local_bins[b]);
+	}
+}
+
+
+// prefix scans
+// work-efficient (Blelloch) scans: every workgroup scans a tile of 2L elements in local memory with an up-sweep that
+// builds partial sums in a balanced tree and a down-sweep that turns them into exclusive prefixes, 2(2L) operations
+// per tile instead of the 2L log(2L) of Hillis-Steele; the tile totals go to block_sums, are scanned the same way
+// (recursively, by the host) and added back with scan_add_offsets, so the whole scan stays O(N)
+//
+// the scanned values are float-float sums (see two_sum_add), so a running total over millions of records keeps enough
+// bits for differences of two prefixes (window sums) to be accurate; count numbers the elements of the current segment
+//
+// segments: an element with head set starts a new segment (a new station), the operator drops everything before it
+// (a, b) -> b.head ? b : (a + b), which is associative, so segmented and plain scans share the kernels
+
+typedef struct {
+	float hi;
+	float lo;
+	uint count;
+	uint head;
+} scan_t;
+
+scan_t scan_identity() {
+	scan_t s;
+	s.hi = 0.0f;
+	s.lo = 0.0f;
+	s.count = 0;
+	s.head = 0;
+	return s;
+}
 
-	int temp = 0;
-	//cache all N values from global memory to local memory
-	scratch[lid] = A[id];
+// a followed by b
+scan_t scan_combine(scan_t a, scan_t b) {
+	if (b.head)
+		return b;
+	float s = a.hi + b.hi;
+	float bb = s - a.hi;
+	float err = (a.hi - (s - bb)) + (b.hi - bb) + a.lo + b.lo;
+	a.hi = s + err;
+	a.lo = err - (a.hi - s);
+	a.count += b.count;
+	return a;
+}
 
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+// in-place exclusive scan of the 2L elements in tile, leaves the tile total in *total
+void scan_tile(__local scan_t* tile, uint lid, uint L, scan_t* total) {
+	uint offset = 1;
+	for (uint d = L; d > 0; d >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint a = offset * (2 * lid + 1) - 1;
+			uint b = offset * (2 * lid + 2) - 1;
+			tile[b] = scan_combine(tile[a], tile[b]);
+		}
+		offset <<= 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	*total = tile[2 * L - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (!lid)
+		tile[2 * L - 1] = scan_identity();
 
-	// adding up elements
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] += scratch[lid + i];
+	for (uint d = 1; d < 2 * L; d <<= 1) {
+		offset >>= 1;
 		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint a = offset * (2 * lid + 1) - 1;
+			uint b = offset * (2 * lid + 2) - 1;
+			scan_t left = tile[a];
+			tile[a] = tile[b];
+			tile[b] = scan_combine(tile[b], left);
+		}
 	}
-	
-	if (!lid) {
-		B[g] = scratch[lid];
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// first level: scans the N floats in A, tile by tile, into B and writes every tile's total to block_sums
+// with segmented set, key (the station column) starts a segment wherever it changes
+// an exclusive result restarts at every segment head (an empty prefix that still carries the head, so the tile
+// offsets added later don't cross it), an inclusive one includes the element itself
+__kernel void scan_values(__global const float* A, __global const ushort* key, uint N, uint segmented, uint inclusive,
+	__global scan_t* B, __global scan_t* block_sums, __local scan_t* tile) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+
+	scan_t x[2];
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		x[k] = scan_identity();
+		if (i < N) {
+			x[k].hi = A[i];
+			x[k].count = 1;
+			x[k].head = segmented && i && (key[i] != key[i - 1]);
+		}
+		tile[lid + k * L] = x[k];
+	}
+
+	scan_t total;
+	scan_tile(tile, lid, L, &total);
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		if (i < N) {
+			scan_t prefix = tile[lid + k * L];
+			if (inclusive)
+				prefix = scan_combine(prefix, x[k]);
+			else if (x[k].head) {
+				prefix = scan_identity();
+				prefix.head = 1;
+			}
+			B[i] = prefix;
+		}
 	}
+	if (!lid)
+		block_sums[get_group_id(0)] = total;
 }
 
-// standard deviation kernal
-__kernel void std_dev(__global const float* A, __global float* B, float mean, __local float* scratch) {
-	int id = get_global_id(0);
-	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	int g = get_group_id(0);
+// upper levels: exclusive scan of N tile totals in place, the totals of these tiles go to block_sums
+__kernel void scan_partials(__global scan_t* P, uint N, __global scan_t* block_sums, __local scan_t* tile) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		tile[lid + k * L] = (i < N) ? P[i] : scan_identity();
+	}
 
-	// cache all N values from global memory to local memory
-	scratch[lid] = A[id];
-	barrier(CLK_GLOBAL_MEM_FENCE); //wait for all threads to finish copying
+	scan_t total;
+	scan_tile(tile, lid, L, &total);
 
-	// working out variance
-	// subtract mean from all values
-	scratch[lid] = scratch[lid] - mean;
-	barrier(CLK_LOCAL_MEM_FENCE); //wait for all threads to finish copying
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		if (i < N)
+			P[i] = tile[lid + k * L];
+	}
+	if (!lid)
+		block_sums[get_group_id(0)] = total;
+}
 
-	// squaring the result
-	scratch[lid] = scratch[lid] * scratch[lid];
-	barrier(CLK_LOCAL_MEM_FENCE); //wait for all threads to finish copying
+// adds the scanned total of every tile before it to each of the 2L elements of a tile
+__kernel void scan_add_offsets(__global scan_t* B, uint N, __global const scan_t* offsets) {
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+	scan_t offset = offsets[get_group_id(0)];
 
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + get_local_id(0) + k * L;
+		if (i < N)
+			B[i] = scan_combine(offset, B[i]);
+	}
+}
+
+// rolling mean over the window days up to every record's day (day - window, day], within the record's segment, from
+// the inclusive segmented scan P
+// day holds the day number of every record, ascending within a segment; the window starts at the first record of the
+// segment inside it, found by binary search (P[i].count gives the segment start), and its sum is the difference of
+// two prefixes, so the arithmetic per record does not grow with the window
+__kernel void rolling_mean(__global const scan_t* P, __global const uint* day, uint N, uint window,
+	__global float* mean, __global uint* count) {
+	uint i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	scan_t last = P[i];
+	uint first = i + 1 - last.count;
+	uint lo = first, hi = i;
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		if (day[mid] + window <= day[i])
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	float sum = last.hi;
+	float sum_lo = last.lo;
+	if (lo > first) {
+		scan_t before = P[lo - 1];
+		sum = (sum - before.hi) + (sum_lo - before.lo);
+		sum_lo = 0.0f;
+	}
+	uint n = i + 1 - lo;
+	mean[i] = (sum + sum_lo) / n;
+	count[i] = n;
+}
 
-	for (int i = 1; i < N; i *= 2) {
-		if (!(lid % (i * 2)) && ((lid + i) < N)) 
-			scratch[lid] += scratch[lid + i];
+// integer scans
+//
+// the same work-efficient scheme as the float-float scans above over uint counts (e.g. 0/1 flags): exact at any
+// length and 4 bytes per element instead of the 16 of a scan_t
+
+// in-place exclusive sum scan of the 2L counts in tile, returns the tile total
+uint scan_count_tile(__local uint* tile, uint lid, uint L) {
+	uint offset = 1;
+	for (uint d = L; d > 0; d >>= 1) {
 		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint a = offset * (2 * lid + 1) - 1;
+			uint b = offset * (2 * lid + 2) - 1;
+			tile[b] += tile[a];
+		}
+		offset <<= 1;
 	}
-	
-	// adding to B
-	if (!lid) {
-		B[g] = scratch[lid];
-	}	
-}
\ No newline at end of file
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint total = tile[2 * L - 1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (!lid)
+		tile[2 * L - 1] = 0;
+
+	for (uint d = 1; d < 2 * L; d <<= 1) {
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint a = offset * (2 * lid + 1) - 1;
+			uint b = offset * (2 * lid + 2) - 1;
+			uint left = tile[a];
+			tile[a] = tile[b];
+			tile[b] += left;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return total;
+}
+
+// exclusive scan of the N counts in C in place, tile by tile; every tile's total goes to block_sums
+__kernel void scan_counts(__global uint* C, uint N, __global uint* block_sums, __local uint* tile) {
+	uint lid = get_local_id(0);
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		tile[lid + k * L] = (i < N) ? C[i] : 0;
+	}
+
+	uint total = scan_count_tile(tile, lid, L);
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + lid + k * L;
+		if (i < N)
+			C[i] = tile[lid + k * L];
+	}
+	if (!lid)
+		block_sums[get_group_id(0)] = total;
+}
+
+// adds the scanned total of every tile before it to each of the 2L counts of a tile
+__kernel void scan_counts_add(__global uint* C, uint N, __global const uint* offsets) {
+	uint L = get_local_size(0);
+	uint base = get_group_id(0) * 2 * L;
+	uint offset = offsets[get_group_id(0)];
+
+	for (uint k = 0; k < 2; k++) {
+		uint i = base + get_local_id(0) + k * L;
+		if (i < N)
+			C[i] += offset;
+	}
+}
+
+// outlier detection
+//
+// z-scores against the statistics of each record's station and calendar month, then a stream compaction: the 0/1
+// flags are scanned in place with scan_counts, which turns them into the output slot of every flagged record, so
+// only the indices of the outliers have to be read back
+
+// months per station in the mean and stddev tables of flag_outliers, see OutlierTables in Outliers.h
+#define OUTLIER_MONTHS 12
+
+// flags every record further than threshold standard deviations from the mean of its station and month
+// the tables hold OUTLIER_MONTHS entries per station (station * 12 + month - 1); a zero stddev (a group of fewer
+// than two records, or of equal ones) and a month out of range never flag
+// flags has N + 1 entries and is launched over all of them: the last one is 0, so once scanned it holds the total
+__kernel void flag_outliers(__global const ushort* station, __global const uint* date, __global const float* A,
+	__global const float* mean, __global const float* stddev, uint N, float threshold, __global uint* flags) {
+	uint i = get_global_id(0);
+	if (i > N)
+		return;
+
+	uint flag = 0;
+	uint month = (i < N) ? (date[i] >> 8) & 0xFF : 0;
+	if (month >= 1 && month <= OUTLIER_MONTHS) {
+		uint g = station[i] * OUTLIER_MONTHS + month - 1;
+		float s = stddev[g];
+		if (s > 0.0f && fabs(A[i] - mean[g]) > threshold * s)
+			flag = 1;
+	}
+	flags[i] = flag;
+}
+
+// writes the index of every flagged record to its slot in indices
+// S is the exclusive scan of the N + 1 flags, so record i was flagged where S[i + 1] differs from S[i], and S[i] is
+// the number of flagged records before it
+__kernel void compact_outliers(__global const uint* S, uint N, __global uint* indices) {
+	uint i = get_global_id(0);
+	if (i >= N)
+		return;
+
+	uint slot = S[i];
+	if (S[i + 1] != slot)
+		indices[slot] = i;
+}